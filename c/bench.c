@@ -0,0 +1,265 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the storage calls. Measures the throughput and the latency
+ * percentiles of set, get and delete over value sizes and fill levels, and
+ * of next_counter, unlock and change_pin over fill levels, and the set with
+ * the flash trace off and on, and prints them as JSON.
+ *
+ * Usage: bench [ITERATIONS]
+ *
+ * The fill level is the approximate share of the norcow sector taken by
+ * live filler items before the measured calls start. The PIN calls run the
+ * full key derivation, so they are measured ITERATIONS / 50 times.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "flash.h"
+#include "norcow_config.h"
+#include "storage.h"
+
+extern uint8_t *FLASH_BUFFER;
+extern const uint32_t FLASH_SIZE;
+
+// norcow prefix, IV and authentication tag of an encrypted item
+#define ITEM_OVERHEAD (4 + 12 + 16)
+#define FILLER_LEN 1024
+#define FILLER_APP 0x02
+#define BENCH_APP 0x01
+#define COUNTER_KEY 0xC001
+#define MAX_KEYS 8
+#define PIN 1
+#define TRACE_FILL 50
+#define TRACE_VALUE_SIZE 64
+
+static const uint16_t value_sizes[] = {0, 1, 16, 64, 256, 1024, 4096, 10000};
+static const uint32_t fill_levels[] = {0, 25, 50, 75};
+
+static const uint8_t salt[] = "bench";
+static uint8_t value[10000];
+static const char *result_sep = "";
+
+static void print_result(const char *op, int value_size, uint32_t fill, bench_samples_t *samples, uint64_t virtual_us)
+{
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+        total_ns += samples->ns[i];
+    }
+    printf("%s\n    {\"op\": \"%s\", ", result_sep, op);
+    if (value_size >= 0) {
+        printf("\"value_size\": %d, ", value_size);
+    }
+    printf("\"fill\": %u, \"ops_per_sec\": %.1f, \"virtual_us\": %llu, \"latency_ns\": ", fill,
+           total_ns ? samples->count * 1e9 / total_ns : 0.0, (unsigned long long)virtual_us);
+    bench_print_latency(samples);
+    printf("}");
+    result_sep = ",";
+    bench_samples_free(samples);
+}
+
+/*
+ * Wipes the storage and fills the given percentage of the sector with
+ * filler items
+ */
+static void setup(uint32_t fill)
+{
+    storage_wipe();
+    storage_init(NULL, salt, sizeof(salt));
+    if (sectrue != storage_unlock(PIN)) {
+        fprintf(stderr, "Failed to unlock the storage\n");
+        exit(1);
+    }
+    const uint32_t count = NORCOW_SECTOR_SIZE / 100 * fill / (FILLER_LEN + ITEM_OVERHEAD);
+    for (uint32_t i = 0; i < count; i++) {
+        if (sectrue != storage_set((FILLER_APP << 8) | i, value, FILLER_LEN)) {
+            fprintf(stderr, "Failed to fill the storage\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Number of keys the measured values rotate over, so that they fit into
+ * a quarter of the free space
+ */
+static uint32_t working_keys(uint32_t fill, uint16_t size)
+{
+    const uint32_t space = NORCOW_SECTOR_SIZE / 100 * (100 - fill) / 4;
+    const uint32_t keys = space / (size + ITEM_OVERHEAD);
+    return keys < 1 ? 1 : keys > MAX_KEYS ? MAX_KEYS : keys;
+}
+
+static void bench_values(uint32_t fill, uint16_t size, uint32_t iterations)
+{
+    bench_samples_t set = {0}, get = {0}, del = {0};
+    uint64_t set_us = 0, get_us = 0, del_us = 0;
+    static uint8_t buf[sizeof(value)];
+    uint16_t len;
+    const uint32_t keys = working_keys(fill, size);
+
+    setup(fill);
+    for (uint32_t i = 0; i < iterations; i++) {
+        const uint16_t key = (BENCH_APP << 8) | (i % keys);
+        memset(value, i, size);
+        uint64_t clock = flash_clock_us();
+        uint64_t start = bench_now_ns();
+        const secbool r = storage_set(key, value, size);
+        bench_sample(&set, bench_now_ns() - start);
+        set_us += flash_clock_us() - clock;
+        if (sectrue != r) {
+            fprintf(stderr, "storage_set failed\n");
+            exit(1);
+        }
+
+        clock = flash_clock_us();
+        start = bench_now_ns();
+        (void)storage_get(key, buf, sizeof(buf), &len);
+        bench_sample(&get, bench_now_ns() - start);
+        get_us += flash_clock_us() - clock;
+    }
+    print_result("set", size, fill, &set, set_us);
+    print_result("get", size, fill, &get, get_us);
+
+    setup(fill);
+    for (uint32_t i = 0; i < iterations; i++) {
+        const uint16_t key = (BENCH_APP << 8) | (i % keys);
+        (void)storage_set(key, value, size);
+        const uint64_t clock = flash_clock_us();
+        const uint64_t start = bench_now_ns();
+        (void)storage_delete(key);
+        bench_sample(&del, bench_now_ns() - start);
+        del_us += flash_clock_us() - clock;
+    }
+    print_result("delete", size, fill, &del, del_us);
+}
+
+static void bench_calls(uint32_t fill, uint32_t iterations)
+{
+    bench_samples_t counter = {0}, unlock = {0}, change_pin = {0};
+    uint64_t counter_us = 0, unlock_us = 0, change_pin_us = 0;
+    uint32_t count, pin = PIN;
+
+    setup(fill);
+    for (uint32_t i = 0; i < iterations; i++) {
+        const uint64_t clock = flash_clock_us();
+        const uint64_t start = bench_now_ns();
+        (void)storage_next_counter(COUNTER_KEY, &count);
+        bench_sample(&counter, bench_now_ns() - start);
+        counter_us += flash_clock_us() - clock;
+    }
+    print_result("next_counter", -1, fill, &counter, counter_us);
+
+    const uint32_t pin_iterations = iterations / 50 < 5 ? 5 : iterations / 50;
+    for (uint32_t i = 0; i < pin_iterations; i++) {
+        storage_lock();
+        uint64_t clock = flash_clock_us();
+        uint64_t start = bench_now_ns();
+        (void)storage_unlock(pin);
+        bench_sample(&unlock, bench_now_ns() - start);
+        unlock_us += flash_clock_us() - clock;
+
+        // toggles between two PINs
+        const uint32_t new_pin = pin == PIN ? PIN + 1 : PIN;
+        clock = flash_clock_us();
+        start = bench_now_ns();
+        (void)storage_change_pin(pin, new_pin);
+        bench_sample(&change_pin, bench_now_ns() - start);
+        change_pin_us += flash_clock_us() - clock;
+        pin = new_pin;
+    }
+    print_result("unlock", -1, fill, &unlock, unlock_us);
+    print_result("change_pin", -1, fill, &change_pin, change_pin_us);
+}
+
+/*
+ * Measures set with the flash trace written to a temporary file or off
+ */
+static void bench_trace(secbool traced, uint32_t iterations, const char *sep)
+{
+    bench_samples_t set = {0};
+    char path[] = "/tmp/bench-trace-XXXXXX";
+    const uint32_t keys = working_keys(TRACE_FILL, TRACE_VALUE_SIZE);
+
+    setup(TRACE_FILL);
+    if (sectrue == traced) {
+        const int fd = mkstemp(path);
+        if (fd < 0 || sectrue != flash_trace_start(path)) {
+            fprintf(stderr, "Failed to start the flash trace\n");
+            exit(1);
+        }
+        close(fd);
+    }
+    for (uint32_t i = 0; i < iterations; i++) {
+        const uint16_t key = (BENCH_APP << 8) | (i % keys);
+        memset(value, i, TRACE_VALUE_SIZE);
+        const uint64_t start = bench_now_ns();
+        const secbool r = storage_set(key, value, TRACE_VALUE_SIZE);
+        bench_sample(&set, bench_now_ns() - start);
+        if (sectrue != r) {
+            fprintf(stderr, "storage_set failed\n");
+            exit(1);
+        }
+    }
+    if (sectrue == traced) {
+        if (sectrue != flash_trace_stop()) {
+            fprintf(stderr, "Failed to write the flash trace\n");
+            exit(1);
+        }
+        unlink(path);
+    }
+
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < set.count; i++) {
+        total_ns += set.ns[i];
+    }
+    printf("%s\n    {\"op\": \"set\", \"value_size\": %d, \"fill\": %d, \"trace\": %d, \"ops_per_sec\": %.1f, \"latency_ns\": ",
+           sep, TRACE_VALUE_SIZE, TRACE_FILL, sectrue == traced, total_ns ? set.count * 1e9 / total_ns : 0.0);
+    bench_print_latency(&set);
+    printf("}");
+    bench_samples_free(&set);
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    FLASH_BUFFER = malloc(FLASH_SIZE);
+    memset(FLASH_BUFFER, 0xFF, FLASH_SIZE);
+    storage_init(NULL, salt, sizeof(salt));
+
+    printf("{\n  \"storage\": \"c\",\n  \"iterations\": %u,\n  \"results\": [", iterations);
+    for (size_t f = 0; f < sizeof(fill_levels) / sizeof(fill_levels[0]); f++) {
+        for (size_t s = 0; s < sizeof(value_sizes) / sizeof(value_sizes[0]); s++) {
+            bench_values(fill_levels[f], value_sizes[s], iterations);
+        }
+        bench_calls(fill_levels[f], iterations);
+    }
+    printf("\n  ],\n  \"trace\": [");
+    bench_trace(secfalse, iterations, "");
+    bench_trace(sectrue, iterations, ",");
+    printf("\n  ]\n}\n");
+
+    free(FLASH_BUFFER);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compaction stress benchmark. Fills the storage with live data up to a
+ * given share of the norcow sector, then churns it with one access pattern
+ * until COMPACTIONS compactions happen, and prints every compaction as
+ * JSON: the duration of the call which triggered it, the bytes copied and
+ * the free space left afterwards.
+ *
+ * Usage: bench_compact [COMPACTIONS]
+ *
+ * A call compacts if it erases a sector. The copied bytes are estimated as
+ * the bytes programmed by that call beyond the magic and beyond the bytes
+ * programmed by the previous call which did not compact. The magic is
+ * followed by the version word. The free space is
+ * read from the active sector.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "flash.h"
+#include "norcow_config.h"
+#include "storage.h"
+
+extern uint8_t *FLASH_BUFFER;
+extern const uint32_t FLASH_SIZE;
+
+#define NORCOW_MAGIC ((uint32_t)0x3243524e)
+#define NORCOW_MAGIC_LEN 8
+// norcow prefix, IV and authentication tag of an encrypted item
+#define ITEM_OVERHEAD (4 + 12 + 16)
+#define FILLER_LEN 1024
+#define FILLER_APP 0x02
+#define MAX_OPS 1000000
+#define COUNTER_KEY 0xC001
+#define PIN 1
+
+typedef enum {
+    HOT_KEY,     // one small key
+    UNIFORM,     // small values over 32 keys
+    BLOBS,       // large values over 2 keys
+    COUNTERS,    // storage_next_counter of one key
+    PATTERN_COUNT
+} pattern_t;
+
+static const char *const pattern_names[PATTERN_COUNT] = {
+    [HOT_KEY] = "hot_key",
+    [UNIFORM] = "uniform",
+    [BLOBS] = "blobs",
+    [COUNTERS] = "counters",
+};
+
+static const uint32_t fill_levels[] = {10, 25, 50, 75, 90, 95, 99};
+
+static uint8_t value[FILLER_LEN * 2];
+static uint32_t rng = 1;
+static const uint8_t salt[] = "bench";
+
+/*
+ * Returns the bytes used in the active sector, or 0 if there is none
+ */
+static uint32_t used_space(void)
+{
+    static const uint8_t sectors[NORCOW_SECTOR_COUNT] = NORCOW_SECTORS;
+    for (int i = 0; i < NORCOW_SECTOR_COUNT; i++) {
+        const uint32_t *magic = flash_get_address(sectors[i], NORCOW_HEADER_LEN, sizeof(uint32_t));
+        if (magic == NULL || *magic != NORCOW_MAGIC) {
+            continue;
+        }
+        uint32_t offset = NORCOW_HEADER_LEN + NORCOW_MAGIC_LEN;
+        while (offset + sizeof(uint32_t) <= NORCOW_SECTOR_SIZE) {
+            const uint32_t *prefix = flash_get_address(sectors[i], offset, sizeof(uint32_t));
+            if ((*prefix & 0xFFFF) == 0xFFFF) {
+                break;
+            }
+            offset += sizeof(uint32_t) + (((*prefix >> 16) + 3) & ~3);
+        }
+        return offset;
+    }
+    return 0;
+}
+
+/*
+ * Runs one call of the pattern, returns its status
+ */
+static secbool churn(pattern_t pattern, uint32_t i)
+{
+    uint32_t count;
+    rng = rng * 1103515245 + 12345;
+    switch (pattern) {
+    case HOT_KEY:
+        return storage_set(0x0101, &i, sizeof(i));
+    case UNIFORM:
+        return storage_set(0x0120 + (rng >> 16) % 32, value, 16);
+    case BLOBS:
+        memset(value, i, sizeof(value));
+        return storage_set(0x0180 + i % 2, value, sizeof(value));
+    case COUNTERS:
+        return storage_next_counter(COUNTER_KEY, &count);
+    default:
+        return secfalse;
+    }
+}
+
+/*
+ * Wipes the storage, writes the working set of the pattern once and fills
+ * the sector with filler items up to fill percent
+ */
+static secbool setup(pattern_t pattern, uint32_t fill)
+{
+    storage_wipe();
+    storage_init(NULL, salt, sizeof(salt));
+    if (sectrue != storage_unlock(PIN)) {
+        return secfalse;
+    }
+    for (uint32_t i = 0; i < 32; i++) {
+        if (sectrue != churn(pattern, i)) {
+            return secfalse;
+        }
+    }
+    const uint32_t target = NORCOW_SECTOR_SIZE / 100 * fill;
+    for (uint16_t key = FILLER_APP << 8; used_space() + ITEM_OVERHEAD < target; key++) {
+        uint32_t len = target - used_space() - ITEM_OVERHEAD;
+        if (len > FILLER_LEN) {
+            len = FILLER_LEN;
+        }
+        if (sectrue != storage_set(key, value, len)) {
+            return secfalse;
+        }
+    }
+    return sectrue;
+}
+
+static uint64_t erase_count(const flash_stats_t *stats)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        count += stats->erase_count[i];
+    }
+    return count;
+}
+
+static void bench_pattern(pattern_t pattern, uint32_t fill, uint32_t compactions)
+{
+    printf("\n    {\"pattern\": \"%s\", \"fill\": %u, ", pattern_names[pattern], fill);
+    if (sectrue != setup(pattern, fill)) {
+        printf("\"error\": \"setup failed\"}");
+        return;
+    }
+
+    bench_samples_t stalls = {0};
+    uint64_t baseline = 0;
+    uint32_t ops = 0;
+    const char *error = NULL;
+    printf("\"events\": [");
+    while (stalls.count < compactions && ops < MAX_OPS) {
+        flash_stats_t before, after;
+        flash_stats_get(&before);
+        const uint64_t start = bench_now_ns();
+        const secbool r = churn(pattern, ops);
+        const uint64_t ns = bench_now_ns() - start;
+        flash_stats_get(&after);
+        ops++;
+        if (sectrue != r) {
+            error = "storage full";
+            break;
+        }
+        const uint64_t programmed = after.programmed_bytes - before.programmed_bytes;
+        if (erase_count(&after) == erase_count(&before)) {
+            baseline = programmed;
+            continue;
+        }
+        const uint64_t overhead = baseline + NORCOW_MAGIC_LEN;
+        printf("%s{\"ns\": %llu, \"bytes_copied\": %llu, \"free_after\": %u}", stalls.count ? ", " : "",
+               (unsigned long long)ns, (unsigned long long)(programmed > overhead ? programmed - overhead : 0),
+               NORCOW_SECTOR_SIZE - used_space());
+        bench_sample(&stalls, ns);
+    }
+    printf("], \"ops\": %u, \"compactions\": %zu, \"stall_ns\": ", ops, stalls.count);
+    bench_print_latency(&stalls);
+    if (error) {
+        printf(", \"error\": \"%s\"", error);
+    }
+    printf("}");
+    bench_samples_free(&stalls);
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t compactions = argc > 1 ? strtoul(argv[1], NULL, 10) : 10;
+    FLASH_BUFFER = malloc(FLASH_SIZE);
+    memset(FLASH_BUFFER, 0xFF, FLASH_SIZE);
+    storage_init(NULL, salt, sizeof(salt));
+
+    printf("{\n  \"storage\": \"c\",\n  \"compactions\": %u,\n  \"results\": [", compactions);
+    const char *sep = "";
+    for (int p = 0; p < PATTERN_COUNT; p++) {
+        for (size_t f = 0; f < sizeof(fill_levels) / sizeof(fill_levels[0]); f++) {
+            printf("%s", sep);
+            bench_pattern(p, fill_levels[f], compactions);
+            sep = ",";
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    free(FLASH_BUFFER);
+    return 0;
+}
@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "flash.h"
 
 void __shutdown(void)
 {
@@ -55,3 +56,8 @@ void error_shutdown(const char *line1, const char *line2, const char *line3, con
     (void) line4;
     return;
 }
+
+void hal_delay(uint32_t ms)
+{
+    flash_clock_advance((uint64_t)ms * 1000);
+}
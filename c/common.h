@@ -27,6 +27,7 @@ void error_shutdown(const char *line1, const char *line2, const char *line3, con
 
 #define ensure(expr, msg) (((expr) == sectrue) ? (void)0 : __fatal_error(#expr, msg, __FILE__, __LINE__, __func__))
 
-#define hal_delay(ms) (void)ms;
+// advances the virtual clock of the flash emulator
+void hal_delay(uint32_t ms);
 
 #endif
@@ -20,6 +20,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
 
 #include "common.h"
 #include "flash.h"
@@ -54,9 +60,74 @@ static const uint32_t FLASH_SECTOR_TABLE[FLASH_SECTOR_COUNT + 1] = {
 const uint32_t FLASH_SIZE = 0x200000;
 uint8_t *FLASH_BUFFER = NULL;
 
+/*
+ * Copy-on-write snapshots of the flash contents.
+ *
+ * flash_images[i] references a saved image equal to the current contents of
+ * sector i, or is NULL if the sector was modified since the last snapshot
+ * or restore. A snapshot copies only the sectors without an image and
+ * shares the others with older snapshots.
+ */
+typedef struct {
+    uint32_t refs;
+    uint8_t data[];
+} flash_image_t;
+
+typedef struct {
+    flash_image_t *sectors[FLASH_SECTOR_COUNT];
+} flash_snapshot_t;
+
+static flash_image_t *flash_images[FLASH_SECTOR_COUNT];
+static const uint8_t *flash_images_buffer = NULL;
+static flash_snapshot_t *flash_snapshots = NULL;
+static int flash_snapshot_count = 0;
+
+static flash_stats_t flash_stats;
+
+#define FLASH_TIMING_DEFAULT { \
+    .byte_program_us = 16, \
+    .word_program_us = 16, \
+    .erase_16k_us = 250000, \
+    .erase_64k_us = 550000, \
+    .erase_128k_us = 1000000, \
+}
+static flash_timing_t flash_timing = FLASH_TIMING_DEFAULT;
+static uint64_t flash_clock = 0;
+
+/*
+ * Page digests, valid for the pages which are not marked in
+ * flash_dirty_map. All of them are recomputed if flash_digests_valid
+ * is false, e.g. after FLASH_BUFFER was modified directly.
+ */
+#define FLASH_PAGE_COUNT (0x200000 / FLASH_DIGEST_PAGE_SIZE)
+
+static uint64_t flash_page_digests[FLASH_PAGE_COUNT];
+static uint32_t flash_dirty_map[FLASH_PAGE_COUNT / 32];
+static uint64_t flash_sector_digests[FLASH_SECTOR_COUNT];
+static bool flash_digests_valid = false;
+
+/*
+ * Trace recorder. Events are appended to a single-producer single-consumer
+ * ring buffer and a writer thread drains it into the trace file. When the
+ * ring is full the producer waits for the writer, so no events are lost.
+ */
+#define FLASH_TRACE_RING_SIZE (1 << 16)
+
+static flash_trace_event_t flash_trace_ring[FLASH_TRACE_RING_SIZE];
+static atomic_uint flash_trace_head;
+static atomic_uint flash_trace_tail;
+static atomic_bool flash_trace_enabled;
+static atomic_bool flash_trace_running;
+// whether the writer failed to write any events
+static atomic_bool flash_trace_failed;
+static uint32_t flash_trace_seq = 0;
+static FILE *flash_trace_file = NULL;
+static pthread_t flash_trace_thread;
+
 void flash_init(void)
 {
     assert(FLASH_SIZE == FLASH_SECTOR_TABLE[FLASH_SECTOR_COUNT] - FLASH_SECTOR_TABLE[0]);
+    assert(FLASH_SIZE == FLASH_PAGE_COUNT * FLASH_DIGEST_PAGE_SIZE);
 }
 
 secbool flash_unlock_write(void)
@@ -69,7 +140,39 @@ secbool flash_lock_write(void)
     return sectrue;
 }
 
-const void *flash_get_address(uint8_t sector, uint32_t offset, uint32_t size)
+static void image_release(flash_image_t *image)
+{
+    if (image && --image->refs == 0) {
+        free(image);
+    }
+}
+
+static void mark_dirty(uint8_t sector)
+{
+    image_release(flash_images[sector]);
+    flash_images[sector] = NULL;
+}
+
+static void mark_pages(uint8_t sector, uint32_t offset, uint32_t len)
+{
+    const uint32_t addr = FLASH_SECTOR_TABLE[sector] - FLASH_SECTOR_TABLE[0] + offset;
+    for (uint32_t p = addr / FLASH_DIGEST_PAGE_SIZE; p <= (addr + len - 1) / FLASH_DIGEST_PAGE_SIZE; p++) {
+        flash_dirty_map[p / 32] |= 1u << (p % 32);
+    }
+}
+
+/*
+ * Drops the cached images if FLASH_BUFFER was replaced since they were taken
+ */
+static void check_images_buffer(void)
+{
+    if (flash_images_buffer != FLASH_BUFFER) {
+        flash_snapshot_dirty();
+        flash_images_buffer = FLASH_BUFFER;
+    }
+}
+
+static void *flash_address(uint8_t sector, uint32_t offset, uint32_t size)
 {
     if (sector >= FLASH_SECTOR_COUNT) {
         return NULL;
@@ -82,6 +185,66 @@ const void *flash_get_address(uint8_t sector, uint32_t offset, uint32_t size)
     return FLASH_BUFFER + addr - FLASH_SECTOR_TABLE[0];
 }
 
+static void trace(uint8_t op, uint8_t sector, uint32_t offset, uint32_t len, uint32_t data)
+{
+    if (!atomic_load_explicit(&flash_trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    const unsigned int head = atomic_load_explicit(&flash_trace_head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&flash_trace_tail, memory_order_acquire) == FLASH_TRACE_RING_SIZE) {
+        sched_yield();
+    }
+    flash_trace_event_t *event = &flash_trace_ring[head % FLASH_TRACE_RING_SIZE];
+    event->seq = flash_trace_seq++;
+    event->op = op;
+    event->sector = sector;
+    event->reserved = 0;
+    event->offset = offset;
+    event->len = len;
+    event->data = data;
+    atomic_store_explicit(&flash_trace_head, head + 1, memory_order_release);
+}
+
+static void *trace_writer(void *arg)
+{
+    (void)arg;
+    const struct timespec idle = {0, 100000};
+    for (;;) {
+        const bool running = atomic_load_explicit(&flash_trace_running, memory_order_acquire);
+        const unsigned int head = atomic_load_explicit(&flash_trace_head, memory_order_acquire);
+        const unsigned int tail = atomic_load_explicit(&flash_trace_tail, memory_order_relaxed);
+        if (head == tail) {
+            if (!running) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        // write the contiguous part of the ring
+        const unsigned int start = tail % FLASH_TRACE_RING_SIZE;
+        unsigned int count = head - tail;
+        if (start + count > FLASH_TRACE_RING_SIZE) {
+            count = FLASH_TRACE_RING_SIZE - start;
+        }
+        if (fwrite(&flash_trace_ring[start], sizeof(flash_trace_event_t), count, flash_trace_file) != count) {
+            // keep draining the ring so that the producer does not wait
+            atomic_store(&flash_trace_failed, true);
+        }
+        atomic_store_explicit(&flash_trace_tail, tail + count, memory_order_release);
+    }
+    return NULL;
+}
+
+const void *flash_get_address(uint8_t sector, uint32_t offset, uint32_t size)
+{
+    const void *flash = flash_address(sector, offset, size);
+    if (flash) {
+        flash_stats.read_bytes += size;
+        trace(FLASH_TRACE_READ, sector, offset, size, 0);
+    }
+    return flash;
+}
+
 secbool flash_erase_sectors(const uint8_t *sectors, int len, void (*progress)(int pos, int len))
 {
     if (progress) {
@@ -92,6 +255,17 @@ secbool flash_erase_sectors(const uint8_t *sectors, int len, void (*progress)(in
         const uint32_t offset = FLASH_SECTOR_TABLE[sector] - FLASH_SECTOR_TABLE[0];
         const uint32_t size = FLASH_SECTOR_TABLE[sector + 1] - FLASH_SECTOR_TABLE[sector];
         memset(FLASH_BUFFER + offset, 0xFF, size);
+        mark_dirty(sector);
+        mark_pages(sector, 0, size);
+        flash_stats.erase_count[sector]++;
+        trace(FLASH_TRACE_ERASE, sector, 0, size, 0);
+        if (size <= 16 * 1024) {
+            flash_clock += flash_timing.erase_16k_us;
+        } else if (size <= 64 * 1024) {
+            flash_clock += flash_timing.erase_64k_us;
+        } else {
+            flash_clock += flash_timing.erase_128k_us;
+        }
         if (progress) {
             progress(i + 1, len);
         }
@@ -99,31 +273,345 @@ secbool flash_erase_sectors(const uint8_t *sectors, int len, void (*progress)(in
     return sectrue;
 }
 
-secbool flash_write_byte(uint8_t sector, uint32_t offset, uint8_t data)
+static secbool program_byte(uint8_t sector, uint32_t offset, uint8_t *flash, uint8_t data)
 {
-    uint8_t *flash = (uint8_t *)flash_get_address(sector, offset, 1);
-    if (!flash) {
-        return secfalse;
+    trace(FLASH_TRACE_WRITE_BYTE, sector, offset, sizeof(data), data);
+    flash_stats.byte_writes++;
+    flash_clock += flash_timing.byte_program_us;
+    if ((flash[0] & data) != data) {
+        flash_stats.rejected_writes++;
+        return secfalse;  // we cannot change zeroes to ones
     }
+    flash[0] = data;
+    mark_pages(sector, offset, sizeof(data));
+    flash_stats.programmed_bytes += sizeof(data);
+    return sectrue;
+}
+
+static secbool program_word(uint8_t sector, uint32_t offset, uint32_t *flash, uint32_t data)
+{
+    trace(FLASH_TRACE_WRITE_WORD, sector, offset, sizeof(data), data);
+    flash_stats.word_writes++;
+    flash_clock += flash_timing.word_program_us;
     if ((flash[0] & data) != data) {
+        flash_stats.rejected_writes++;
         return secfalse;  // we cannot change zeroes to ones
     }
     flash[0] = data;
+    mark_pages(sector, offset, sizeof(data));
+    flash_stats.programmed_bytes += sizeof(data);
     return sectrue;
 }
 
+secbool flash_write_byte(uint8_t sector, uint32_t offset, uint8_t data)
+{
+    uint8_t *flash = (uint8_t *)flash_address(sector, offset, 1);
+    if (!flash) {
+        return secfalse;
+    }
+    mark_dirty(sector);
+    return program_byte(sector, offset, flash, data);
+}
+
 secbool flash_write_word(uint8_t sector, uint32_t offset, uint32_t data)
 {
     if (offset % 4) {  // we write only at 4-byte boundary
         return secfalse;
     }
-    uint32_t *flash = (uint32_t *)flash_get_address(sector, offset, sizeof(data));
+    uint32_t *flash = (uint32_t *)flash_address(sector, offset, sizeof(data));
     if (!flash) {
         return secfalse;
     }
-    if ((flash[0] & data) != data) {
-        return secfalse;  // we cannot change zeroes to ones
+    mark_dirty(sector);
+    return program_word(sector, offset, flash, data);
+}
+
+secbool flash_write_block(uint8_t sector, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+    uint8_t *flash = (uint8_t *)flash_address(sector, offset, len);
+    if (!flash) {
+        return secfalse;
+    }
+    mark_dirty(sector);
+    uint32_t i = 0;
+    // unaligned head
+    for (; i < len && (offset + i) % 4; i++) {
+        if (sectrue != program_byte(sector, offset + i, flash + i, data[i])) {
+            return secfalse;
+        }
+    }
+    // aligned words
+    for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (sectrue != program_word(sector, offset + i, (uint32_t *)(flash + i), word)) {
+            return secfalse;
+        }
+    }
+    // unaligned tail
+    for (; i < len; i++) {
+        if (sectrue != program_byte(sector, offset + i, flash + i, data[i])) {
+            return secfalse;
+        }
+    }
+    return sectrue;
+}
+
+int flash_snapshot(void)
+{
+    check_images_buffer();
+    int id = 0;
+    while (id < flash_snapshot_count && flash_snapshots[id].sectors[0] != NULL) {
+        id++;
+    }
+    if (id == flash_snapshot_count) {
+        const int count = flash_snapshot_count ? 2 * flash_snapshot_count : 16;
+        flash_snapshot_t *snapshots = realloc(flash_snapshots, count * sizeof(flash_snapshot_t));
+        if (!snapshots) {
+            return -1;
+        }
+        memset(snapshots + flash_snapshot_count, 0, (count - flash_snapshot_count) * sizeof(flash_snapshot_t));
+        flash_snapshots = snapshots;
+        flash_snapshot_count = count;
+    }
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        if (flash_images[i] == NULL) {
+            const uint32_t offset = FLASH_SECTOR_TABLE[i] - FLASH_SECTOR_TABLE[0];
+            const uint32_t size = FLASH_SECTOR_TABLE[i + 1] - FLASH_SECTOR_TABLE[i];
+            flash_image_t *image = malloc(sizeof(flash_image_t) + size);
+            if (!image) {
+                return -1;
+            }
+            image->refs = 1;
+            memcpy(image->data, FLASH_BUFFER + offset, size);
+            flash_images[i] = image;
+        }
+    }
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        flash_images[i]->refs++;
+        flash_snapshots[id].sectors[i] = flash_images[i];
+    }
+    return id;
+}
+
+secbool flash_restore(int id)
+{
+    if (id < 0 || id >= flash_snapshot_count || flash_snapshots[id].sectors[0] == NULL) {
+        return secfalse;
+    }
+    check_images_buffer();
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        flash_image_t *image = flash_snapshots[id].sectors[i];
+        if (flash_images[i] == image) {
+            continue;
+        }
+        const uint32_t offset = FLASH_SECTOR_TABLE[i] - FLASH_SECTOR_TABLE[0];
+        const uint32_t size = FLASH_SECTOR_TABLE[i + 1] - FLASH_SECTOR_TABLE[i];
+        memcpy(FLASH_BUFFER + offset, image->data, size);
+        mark_pages(i, 0, size);
+        image_release(flash_images[i]);
+        image->refs++;
+        flash_images[i] = image;
     }
-    flash[0] = data;
     return sectrue;
 }
+
+void flash_snapshot_free(int id)
+{
+    if (id < 0 || id >= flash_snapshot_count) {
+        return;
+    }
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        image_release(flash_snapshots[id].sectors[i]);
+        flash_snapshots[id].sectors[i] = NULL;
+    }
+}
+
+void flash_snapshot_dirty(void)
+{
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        mark_dirty(i);
+    }
+    flash_digests_valid = false;
+}
+
+void flash_reset(void)
+{
+    (void)flash_trace_stop();
+    for (int id = 0; id < flash_snapshot_count; id++) {
+        flash_snapshot_free(id);
+    }
+    free(flash_snapshots);
+    flash_snapshots = NULL;
+    flash_snapshot_count = 0;
+    flash_snapshot_dirty();
+    flash_stats_reset();
+    flash_timing = (flash_timing_t)FLASH_TIMING_DEFAULT;
+    flash_clock = 0;
+}
+
+void flash_stats_reset(void)
+{
+    memset(&flash_stats, 0, sizeof(flash_stats));
+}
+
+void flash_stats_get(flash_stats_t *stats)
+{
+    *stats = flash_stats;
+}
+
+void flash_timing_set(const flash_timing_t *timing)
+{
+    flash_timing = *timing;
+}
+
+void flash_timing_get(flash_timing_t *timing)
+{
+    *timing = flash_timing;
+}
+
+uint64_t flash_clock_us(void)
+{
+    return flash_clock;
+}
+
+void flash_clock_advance(uint64_t us)
+{
+    flash_clock += us;
+}
+
+static uint64_t add_mod(uint64_t a, uint64_t b)
+{
+    // a, b < FLASH_DIGEST_PRIME
+    return a >= FLASH_DIGEST_PRIME - b ? a - (FLASH_DIGEST_PRIME - b) : a + b;
+}
+
+static uint64_t page_digest(const uint8_t *page)
+{
+    // Horner's scheme from the most significant word
+    uint64_t h = 0;
+    for (int i = FLASH_DIGEST_PAGE_SIZE - (int)sizeof(uint64_t); i >= 0; i -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, page + i, sizeof(word));
+        for (int bit = 0; bit < 64; bit++) {
+            h = add_mod(h, h);
+        }
+        h = add_mod(h, word % FLASH_DIGEST_PRIME);
+    }
+    return h;
+}
+
+static uint64_t mix_page_digest(uint32_t page, uint64_t digest)
+{
+    // splitmix64 finalizer
+    uint64_t z = digest + page * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void refresh_digests(uint8_t sector)
+{
+    check_images_buffer();
+    if (!flash_digests_valid) {
+        memset(flash_dirty_map, 0xFF, sizeof(flash_dirty_map));
+        memset(flash_page_digests, 0, sizeof(flash_page_digests));
+        for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+            const uint32_t pages = (FLASH_SECTOR_TABLE[i + 1] - FLASH_SECTOR_TABLE[i]) / FLASH_DIGEST_PAGE_SIZE;
+            flash_sector_digests[i] = 0;
+            for (uint32_t page = 0; page < pages; page++) {
+                flash_sector_digests[i] ^= mix_page_digest(page, 0);
+            }
+        }
+        flash_digests_valid = true;
+    }
+    const uint32_t first = (FLASH_SECTOR_TABLE[sector] - FLASH_SECTOR_TABLE[0]) / FLASH_DIGEST_PAGE_SIZE;
+    const uint32_t last = (FLASH_SECTOR_TABLE[sector + 1] - FLASH_SECTOR_TABLE[0]) / FLASH_DIGEST_PAGE_SIZE;
+    for (uint32_t p = first; p < last; p++) {
+        if ((flash_dirty_map[p / 32] & (1u << (p % 32))) == 0) {
+            continue;
+        }
+        const uint64_t digest = page_digest(FLASH_BUFFER + p * FLASH_DIGEST_PAGE_SIZE);
+        flash_sector_digests[sector] ^= mix_page_digest(p - first, flash_page_digests[p]) ^ mix_page_digest(p - first, digest);
+        flash_page_digests[p] = digest;
+        flash_dirty_map[p / 32] &= ~(1u << (p % 32));
+    }
+}
+
+uint64_t flash_digest(uint8_t sector)
+{
+    if (sector >= FLASH_SECTOR_COUNT) {
+        return 0;
+    }
+    refresh_digests(sector);
+    return flash_sector_digests[sector];
+}
+
+uint64_t flash_page_digest(uint8_t sector, uint32_t page)
+{
+    if (sector >= FLASH_SECTOR_COUNT || page >= (FLASH_SECTOR_TABLE[sector + 1] - FLASH_SECTOR_TABLE[sector]) / FLASH_DIGEST_PAGE_SIZE) {
+        return 0;
+    }
+    refresh_digests(sector);
+    return flash_page_digests[(FLASH_SECTOR_TABLE[sector] - FLASH_SECTOR_TABLE[0]) / FLASH_DIGEST_PAGE_SIZE + page];
+}
+
+uint32_t flash_dirty_pages(uint8_t sector, uint32_t *pages, uint32_t max)
+{
+    if (sector >= FLASH_SECTOR_COUNT) {
+        return 0;
+    }
+    check_images_buffer();
+    const uint32_t first = (FLASH_SECTOR_TABLE[sector] - FLASH_SECTOR_TABLE[0]) / FLASH_DIGEST_PAGE_SIZE;
+    const uint32_t last = (FLASH_SECTOR_TABLE[sector + 1] - FLASH_SECTOR_TABLE[0]) / FLASH_DIGEST_PAGE_SIZE;
+    uint32_t count = 0;
+    for (uint32_t p = first; p < last && count < max; p++) {
+        if (!flash_digests_valid || (flash_dirty_map[p / 32] & (1u << (p % 32)))) {
+            pages[count++] = p - first;
+        }
+    }
+    return count;
+}
+
+secbool flash_trace_start(const char *path)
+{
+    if (flash_trace_file) {
+        return secfalse;
+    }
+    flash_trace_file = fopen(path, "wb");
+    if (!flash_trace_file) {
+        return secfalse;
+    }
+    const uint32_t header[3] = {FLASH_TRACE_MAGIC, FLASH_TRACE_VERSION, sizeof(flash_trace_event_t)};
+    if (fwrite(header, sizeof(header), 1, flash_trace_file) != 1) {
+        fclose(flash_trace_file);
+        flash_trace_file = NULL;
+        return secfalse;
+    }
+    flash_trace_seq = 0;
+    atomic_store(&flash_trace_head, 0);
+    atomic_store(&flash_trace_tail, 0);
+    atomic_store(&flash_trace_failed, false);
+    atomic_store(&flash_trace_running, true);
+    if (pthread_create(&flash_trace_thread, NULL, trace_writer, NULL) != 0) {
+        fclose(flash_trace_file);
+        flash_trace_file = NULL;
+        return secfalse;
+    }
+    atomic_store(&flash_trace_enabled, true);
+    return sectrue;
+}
+
+secbool flash_trace_stop(void)
+{
+    if (!flash_trace_file) {
+        return sectrue;
+    }
+    atomic_store(&flash_trace_enabled, false);
+    atomic_store(&flash_trace_running, false);
+    pthread_join(flash_trace_thread, NULL);
+    // closing flushes the buffered events, which may fail too
+    const bool failed = fclose(flash_trace_file) != 0 || atomic_load(&flash_trace_failed);
+    flash_trace_file = NULL;
+    return failed ? secfalse : sectrue;
+}
@@ -28,6 +28,13 @@
 
 void flash_init(void);
 
+/*
+ * Restores the emulator state kept besides the flash contents, that is the
+ * default timing, zero counters and clock, no snapshots and no running
+ * trace, so that the tests can reuse the library for a new storage.
+ */
+void flash_reset(void);
+
 secbool __wur flash_unlock_write(void);
 secbool __wur flash_lock_write(void);
 
@@ -37,5 +44,98 @@ secbool __wur flash_erase_sectors(const uint8_t *sectors, int len, void (*progre
 static inline secbool flash_erase(uint8_t sector) { return flash_erase_sectors(&sector, 1, NULL); }
 secbool __wur flash_write_byte(uint8_t sector, uint32_t offset, uint8_t data);
 secbool __wur flash_write_word(uint8_t sector, uint32_t offset, uint32_t data);
+secbool __wur flash_write_block(uint8_t sector, uint32_t offset, const uint8_t *data, uint32_t len);
+
+/*
+ * Copy-on-write snapshots of the whole flash, used by the tests to fork
+ * the storage state. flash_snapshot() returns the snapshot id, or -1 on
+ * failure. Any RAM state kept on top of the flash must be re-initialized
+ * after flash_restore(). Call flash_snapshot_dirty() after modifying
+ * FLASH_BUFFER directly.
+ */
+int flash_snapshot(void);
+secbool __wur flash_restore(int id);
+void flash_snapshot_free(int id);
+void flash_snapshot_dirty(void);
+
+/*
+ * Flash operation counters of the emulator. Writes are counted per program
+ * operation, including the rejected ones which try to change a zero to
+ * a one. Reads count the bytes requested through flash_get_address().
+ */
+typedef struct {
+    uint32_t erase_count[FLASH_SECTOR_COUNT];
+    uint64_t byte_writes;
+    uint64_t word_writes;
+    uint64_t rejected_writes;
+    uint64_t programmed_bytes;
+    uint64_t read_bytes;
+} flash_stats_t;
+
+void flash_stats_reset(void);
+void flash_stats_get(flash_stats_t *stats);
+
+/*
+ * Timing model of the emulator. Every flash operation is charged to a
+ * virtual clock, so the tests can estimate the latency on a device.
+ * The defaults are the typical STM32F4 figures at x32 parallelism.
+ */
+typedef struct {
+    uint32_t byte_program_us;
+    uint32_t word_program_us;
+    uint32_t erase_16k_us;
+    uint32_t erase_64k_us;
+    uint32_t erase_128k_us;
+} flash_timing_t;
+
+void flash_timing_set(const flash_timing_t *timing);
+void flash_timing_get(flash_timing_t *timing);
+uint64_t flash_clock_us(void);
+void flash_clock_advance(uint64_t us);
+
+/*
+ * Incremental digests of the flash contents in 256-byte pages. The digest
+ * of a page is the page read as a little-endian integer modulo
+ * FLASH_DIGEST_PRIME, and the digest of a sector is the XOR of its page
+ * digests mixed with the page number. Only the pages touched since the last
+ * query of the sector are rehashed. flash_dirty_pages() stores up to max
+ * such page numbers, relative to the sector, and returns their count.
+ */
+#define FLASH_DIGEST_PAGE_SIZE 256
+#define FLASH_DIGEST_PRIME     ((uint64_t)0x9E3779B97F4A7BB9)
+
+uint64_t flash_digest(uint8_t sector);
+uint64_t flash_page_digest(uint8_t sector, uint32_t page);
+uint32_t flash_dirty_pages(uint8_t sector, uint32_t *pages, uint32_t max);
+
+/*
+ * Binary trace of the flash operations. The file starts with a header of
+ * three 32-bit words (magic, version, event size) followed by the events.
+ * Every program operation is recorded separately, also the rejected ones,
+ * and data holds the programmed byte or word.
+ */
+#define FLASH_TRACE_MAGIC   ((uint32_t)0x43525446)  // FTRC
+#define FLASH_TRACE_VERSION ((uint32_t)0x00000001)
+
+enum {
+    FLASH_TRACE_ERASE = 1,
+    FLASH_TRACE_WRITE_BYTE = 2,
+    FLASH_TRACE_WRITE_WORD = 3,
+    FLASH_TRACE_READ = 4,
+};
+
+typedef struct {
+    uint32_t seq;
+    uint8_t op;
+    uint8_t sector;
+    uint16_t reserved;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t data;
+} flash_trace_event_t;
+
+secbool __wur flash_trace_start(const char *path);
+// returns secfalse if any part of the trace could not be written
+secbool flash_trace_stop(void);
 
 #endif
@@ -0,0 +1,153 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memoization of PBKDF2-HMAC-SHA256 for the tests, which unlock the storage
+ * with the same PIN and salt over and over.
+ *
+ * The vendor storage cannot be changed, so the library is linked with
+ * --wrap for the pbkdf2_hmac_sha256_* functions and its calls land here.
+ * While the cache is enabled, Update() only counts the iterations and
+ * Final() looks up the key by the context right after Init(), which depends
+ * only on the password, the salt and the block number, and by the number of
+ * iterations. On a miss all the iterations are run at once.
+ */
+
+#ifndef TREZOR_STORAGE_TEST
+#error "kdf_cache.c must not be used outside of the test builds"
+#endif
+
+#include <string.h>
+
+#include "kdf_cache.h"
+#include "pbkdf2.h"
+
+void __real_pbkdf2_hmac_sha256_Init(PBKDF2_HMAC_SHA256_CTX *pctx, const uint8_t *pass, int passlen, const uint8_t *salt, int saltlen, uint32_t blocknr);
+void __real_pbkdf2_hmac_sha256_Update(PBKDF2_HMAC_SHA256_CTX *pctx, uint32_t iterations);
+void __real_pbkdf2_hmac_sha256_Final(PBKDF2_HMAC_SHA256_CTX *pctx, uint8_t *key);
+
+void __wrap_pbkdf2_hmac_sha256_Init(PBKDF2_HMAC_SHA256_CTX *pctx, const uint8_t *pass, int passlen, const uint8_t *salt, int saltlen, uint32_t blocknr);
+void __wrap_pbkdf2_hmac_sha256_Update(PBKDF2_HMAC_SHA256_CTX *pctx, uint32_t iterations);
+void __wrap_pbkdf2_hmac_sha256_Final(PBKDF2_HMAC_SHA256_CTX *pctx, uint8_t *key);
+
+#define KDF_CACHE_SIZE 64
+#define KDF_PENDING_SIZE 4
+
+typedef struct {
+    uint32_t odig[SHA256_DIGEST_LENGTH / sizeof(uint32_t)];
+    uint32_t idig[SHA256_DIGEST_LENGTH / sizeof(uint32_t)];
+    uint32_t f[SHA256_DIGEST_LENGTH / sizeof(uint32_t)];
+    uint32_t iterations;
+} kdf_cache_key_t;
+
+typedef struct {
+    kdf_cache_key_t key;
+    uint8_t out[SHA256_DIGEST_LENGTH];
+    uint32_t used;  // 0 for an empty entry
+} kdf_cache_entry_t;
+
+// contexts initialized while the cache was enabled, with deferred iterations
+typedef struct {
+    PBKDF2_HMAC_SHA256_CTX *pctx;
+    kdf_cache_key_t key;
+} kdf_pending_t;
+
+static secbool kdf_cache_enabled = secfalse;
+static kdf_cache_entry_t kdf_cache[KDF_CACHE_SIZE];
+static kdf_pending_t kdf_pending[KDF_PENDING_SIZE];
+static uint32_t kdf_cache_clock = 0;
+
+void kdf_cache_enable(secbool enable)
+{
+    kdf_cache_enabled = enable;
+    if (sectrue != enable) {
+        memset(kdf_cache, 0, sizeof(kdf_cache));
+        memset(kdf_pending, 0, sizeof(kdf_pending));
+    }
+}
+
+static kdf_pending_t *find_pending(const PBKDF2_HMAC_SHA256_CTX *pctx)
+{
+    for (int i = 0; i < KDF_PENDING_SIZE; i++) {
+        if (kdf_pending[i].pctx == pctx) {
+            return &kdf_pending[i];
+        }
+    }
+    return NULL;
+}
+
+void __wrap_pbkdf2_hmac_sha256_Init(PBKDF2_HMAC_SHA256_CTX *pctx, const uint8_t *pass, int passlen, const uint8_t *salt, int saltlen, uint32_t blocknr)
+{
+    __real_pbkdf2_hmac_sha256_Init(pctx, pass, passlen, salt, saltlen, blocknr);
+    kdf_pending_t *pending = find_pending(pctx);
+    if (pending) {
+        pending->pctx = NULL;  // the context is reused without Final()
+    }
+    if (sectrue != kdf_cache_enabled) {
+        return;
+    }
+    pending = find_pending(NULL);
+    if (pending == NULL) {
+        return;
+    }
+    pending->pctx = pctx;
+    memcpy(pending->key.odig, pctx->odig, sizeof(pending->key.odig));
+    memcpy(pending->key.idig, pctx->idig, sizeof(pending->key.idig));
+    memcpy(pending->key.f, pctx->f, sizeof(pending->key.f));
+    pending->key.iterations = 0;
+}
+
+void __wrap_pbkdf2_hmac_sha256_Update(PBKDF2_HMAC_SHA256_CTX *pctx, uint32_t iterations)
+{
+    kdf_pending_t *pending = find_pending(pctx);
+    if (pending == NULL) {
+        __real_pbkdf2_hmac_sha256_Update(pctx, iterations);
+        return;
+    }
+    pending->key.iterations += iterations;
+}
+
+void __wrap_pbkdf2_hmac_sha256_Final(PBKDF2_HMAC_SHA256_CTX *pctx, uint8_t *key)
+{
+    kdf_pending_t *pending = find_pending(pctx);
+    if (pending == NULL) {
+        __real_pbkdf2_hmac_sha256_Final(pctx, key);
+        return;
+    }
+    pending->pctx = NULL;
+
+    kdf_cache_entry_t *victim = &kdf_cache[0];
+    for (int i = 0; i < KDF_CACHE_SIZE; i++) {
+        kdf_cache_entry_t *entry = &kdf_cache[i];
+        if (entry->used != 0 && memcmp(&entry->key, &pending->key, sizeof(entry->key)) == 0) {
+            entry->used = ++kdf_cache_clock;
+            memcpy(key, entry->out, SHA256_DIGEST_LENGTH);
+            return;
+        }
+        if (entry->used < victim->used) {
+            victim = entry;
+        }
+    }
+
+    __real_pbkdf2_hmac_sha256_Update(pctx, pending->key.iterations);
+    __real_pbkdf2_hmac_sha256_Final(pctx, key);
+    victim->key = pending->key;
+    memcpy(victim->out, key, SHA256_DIGEST_LENGTH);
+    victim->used = ++kdf_cache_clock;
+}
@@ -0,0 +1,31 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KDF_CACHE_H
+#define KDF_CACHE_H
+
+#include "secbool.h"
+
+/*
+ * Test-only memoization of the PBKDF2 key derivation of the PIN, disabled
+ * by default. Disabling it drops the cached keys. See kdf_cache.c.
+ */
+void kdf_cache_enable(secbool enable);
+
+#endif
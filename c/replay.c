@@ -0,0 +1,225 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays a storage call trace recorded by Storage._call_trace_start() in
+ * storage.py and reports the throughput, the per-call latency percentiles
+ * and the flash operation totals as JSON.
+ *
+ * Usage: replay TRACE [FLASH_IMAGE]
+ *
+ * The trace starts with the magic "STRC" and a 32-bit version, followed by
+ * records of a packed little-endian header (uint8 op, uint16 key,
+ * uint32 arg0, uint32 arg1, uint16 len) and len bytes of data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "flash.h"
+#include "storage.h"
+
+extern uint8_t *FLASH_BUFFER;
+extern const uint32_t FLASH_SIZE;
+
+#define TRACE_MAGIC "STRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_LEN 13
+
+enum {
+    OP_INIT = 1,
+    OP_WIPE = 2,
+    OP_UNLOCK = 3,
+    OP_LOCK = 4,
+    OP_CHANGE_PIN = 5,
+    OP_GET = 6,
+    OP_SET = 7,
+    OP_DELETE = 8,
+    OP_SET_COUNTER = 9,
+    OP_NEXT_COUNTER = 10,
+    OP_CHECK_PIN = 11,
+    OP_COUNT
+};
+
+static const char *const op_names[OP_COUNT] = {
+    [OP_INIT] = "init",
+    [OP_WIPE] = "wipe",
+    [OP_UNLOCK] = "unlock",
+    [OP_LOCK] = "lock",
+    [OP_CHANGE_PIN] = "change_pin",
+    [OP_GET] = "get",
+    [OP_SET] = "set",
+    [OP_DELETE] = "delete",
+    [OP_SET_COUNTER] = "set_counter",
+    [OP_NEXT_COUNTER] = "next_counter",
+    [OP_CHECK_PIN] = "check_pin",
+};
+
+/*
+ * Executes one call, returns 0 if the call is not supported by this storage
+ */
+static int replay_call(uint8_t op, uint16_t key, uint32_t arg0, uint32_t arg1, const uint8_t *data, uint16_t len)
+{
+    static uint8_t val[0x10000];
+    uint16_t val_len;
+    uint32_t count;
+    switch (op) {
+    case OP_INIT:
+        storage_init(NULL, data, len);
+        break;
+    case OP_WIPE:
+        storage_wipe();
+        break;
+    case OP_UNLOCK:
+        (void)storage_unlock(arg0);
+        break;
+    case OP_LOCK:
+        storage_lock();
+        break;
+    case OP_CHANGE_PIN:
+        (void)storage_change_pin(arg0, arg1);
+        break;
+    case OP_GET:
+        (void)storage_get(key, val, sizeof(val) - 1, &val_len);
+        break;
+    case OP_SET:
+        (void)storage_set(key, data, len);
+        break;
+    case OP_DELETE:
+        (void)storage_delete(key);
+        break;
+    case OP_SET_COUNTER:
+        (void)storage_set_counter(key, arg0);
+        break;
+    case OP_NEXT_COUNTER:
+        (void)storage_next_counter(key, &count);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+static int load_image(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    const size_t n = fread(FLASH_BUFFER, 1, FLASH_SIZE, f);
+    fclose(f);
+    return n == FLASH_SIZE;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s TRACE [FLASH_IMAGE]\n", argv[0]);
+        return 1;
+    }
+    FLASH_BUFFER = malloc(FLASH_SIZE);
+    memset(FLASH_BUFFER, 0xFF, FLASH_SIZE);
+    if (argc == 3 && !load_image(argv[2])) {
+        fprintf(stderr, "Failed to load flash image %s\n", argv[2]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    uint8_t magic[8];
+    uint32_t version;
+    if (!f || fread(magic, 1, sizeof(magic), f) != sizeof(magic)) {
+        fprintf(stderr, "Failed to read trace %s\n", argv[1]);
+        return 1;
+    }
+    memcpy(&version, magic + 4, sizeof(version));
+    if (memcmp(magic, TRACE_MAGIC, 4) != 0 || version != TRACE_VERSION) {
+        fprintf(stderr, "Invalid trace %s\n", argv[1]);
+        return 1;
+    }
+
+    static bench_samples_t samples[OP_COUNT];
+    static uint8_t data[0x10000];
+    uint64_t total_ns = 0, skipped = 0;
+    flash_stats_reset();
+    const uint64_t clock_start = flash_clock_us();
+
+    uint8_t hdr[TRACE_HEADER_LEN];
+    while (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+        uint16_t key, len;
+        uint32_t arg0, arg1;
+        const uint8_t op = hdr[0];
+        memcpy(&key, hdr + 1, sizeof(key));
+        memcpy(&arg0, hdr + 3, sizeof(arg0));
+        memcpy(&arg1, hdr + 7, sizeof(arg1));
+        memcpy(&len, hdr + 11, sizeof(len));
+        if (fread(data, 1, len, f) != len) {
+            fprintf(stderr, "Truncated trace %s\n", argv[1]);
+            return 1;
+        }
+        const uint64_t start = bench_now_ns();
+        const int done = replay_call(op, key, arg0, arg1, data, len);
+        const uint64_t ns = bench_now_ns() - start;
+        if (!done || op >= OP_COUNT) {
+            skipped++;
+            continue;
+        }
+        total_ns += ns;
+        bench_sample(&samples[op], ns);
+    }
+    fclose(f);
+
+    flash_stats_t stats;
+    flash_stats_get(&stats);
+    uint64_t calls = 0, erases = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        calls += samples[i].count;
+    }
+    for (int i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        erases += stats.erase_count[i];
+    }
+
+    printf("{\n");
+    printf("  \"calls\": %llu,\n", (unsigned long long)calls);
+    printf("  \"skipped\": %llu,\n", (unsigned long long)skipped);
+    printf("  \"ops_per_sec\": %.1f,\n", total_ns ? calls * 1e9 / total_ns : 0.0);
+    printf("  \"virtual_us\": %llu,\n", (unsigned long long)(flash_clock_us() - clock_start));
+    printf("  \"latency_ns\": {");
+    const char *sep = "";
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (samples[i].count == 0) {
+            continue;
+        }
+        printf("%s\n    \"%s\": ", sep, op_names[i]);
+        bench_print_latency(&samples[i]);
+        sep = ",";
+        bench_samples_free(&samples[i]);
+    }
+    printf("\n  },\n");
+    printf("  \"flash\": {\"erases\": %llu, \"byte_writes\": %llu, \"word_writes\": %llu, "
+           "\"programmed_bytes\": %llu, \"read_bytes\": %llu}\n",
+           (unsigned long long)erases, (unsigned long long)stats.byte_writes,
+           (unsigned long long)stats.word_writes, (unsigned long long)stats.programmed_bytes,
+           (unsigned long long)stats.read_bytes);
+    printf("}\n");
+
+    free(FLASH_BUFFER);
+    return 0;
+}
@@ -1,27 +1,175 @@
 import ctypes as c
+import mmap
 import os
+import shutil
+import struct
+import tempfile
+import threading
+import weakref
 
 sectrue = -1431655766  # 0xAAAAAAAAA
 fname = os.path.join(os.path.dirname(__file__), "libtrezor-storage.so")
 
+# The dynamic loader returns the same handle for every load of one file, so
+# all instances would share the flash and the storage state. Every instance
+# therefore gets its own copy of the library, which is returned to a pool
+# once the instance is garbage collected.
+_libs = []
+_libs_lock = threading.Lock()
+
+
+def _acquire_lib() -> c.CDLL:
+    with _libs_lock:
+        if _libs:
+            return _libs.pop()
+    with tempfile.NamedTemporaryFile(dir=os.path.dirname(fname), suffix=".so") as tmp:
+        with open(fname, "rb") as lib:
+            shutil.copyfileobj(lib, tmp)
+        tmp.flush()
+        return c.CDLL(tmp.name)
+
+
+def _release_lib(lib: c.CDLL) -> None:
+    with _libs_lock:
+        _libs.append(lib)
+
+
+# Test-only memoization of the PIN key derivation, see kdf_cache.c. It applies
+# to the instances created after the call.
+_kdf_cache = False
+
+
+def enable_kdf_cache(enable: bool = True) -> None:
+    global _kdf_cache
+    _kdf_cache = enable
+
+
+FLASH_SECTOR_COUNT = 24
+NORCOW_SECTORS = (4, 16)
+NORCOW_SECTOR_SIZE = 0x10000
+DIGEST_PAGE_COUNT = NORCOW_SECTOR_SIZE // 256
+
+
+class FlashStats(c.Structure):
+    # mirrors flash_stats_t in flash.h
+    _fields_ = [
+        ("erase_count", c.c_uint32 * FLASH_SECTOR_COUNT),
+        ("byte_writes", c.c_uint64),
+        ("word_writes", c.c_uint64),
+        ("rejected_writes", c.c_uint64),
+        ("programmed_bytes", c.c_uint64),
+        ("read_bytes", c.c_uint64),
+    ]
+
+
+class FlashTiming(c.Structure):
+    # mirrors flash_timing_t in flash.h, all values in microseconds
+    _fields_ = [
+        ("byte_program_us", c.c_uint32),
+        ("word_program_us", c.c_uint32),
+        ("erase_16k_us", c.c_uint32),
+        ("erase_64k_us", c.c_uint32),
+        ("erase_128k_us", c.c_uint32),
+    ]
+
+
+class FlashTraceEvent(c.Structure):
+    # mirrors flash_trace_event_t in flash.h
+    _fields_ = [
+        ("seq", c.c_uint32),
+        ("op", c.c_uint8),
+        ("sector", c.c_uint8),
+        ("reserved", c.c_uint16),
+        ("offset", c.c_uint32),
+        ("len", c.c_uint32),
+        ("data", c.c_uint32),
+    ]
+
+
+FLASH_TRACE_MAGIC = 0x43525446
+FLASH_TRACE_ERASE = 1
+FLASH_TRACE_WRITE_BYTE = 2
+FLASH_TRACE_WRITE_WORD = 3
+FLASH_TRACE_READ = 4
+
+
+def read_flash_trace(path: str):
+    with open(path, "rb") as f:
+        magic, _, size = struct.unpack("<III", f.read(12))
+        if magic != FLASH_TRACE_MAGIC or size != c.sizeof(FlashTraceEvent):
+            raise RuntimeError("Invalid flash trace file.")
+        while True:
+            data = f.read(size)
+            if len(data) < size:
+                return
+            yield FlashTraceEvent.from_buffer_copy(data)
+
+
+# Storage call trace replayed by replay.c.
+CALL_TRACE_MAGIC = b"STRC"
+CALL_TRACE_VERSION = 1
+CALL_INIT = 1
+CALL_WIPE = 2
+CALL_UNLOCK = 3
+CALL_LOCK = 4
+CALL_CHANGE_PIN = 5
+CALL_GET = 6
+CALL_SET = 7
+CALL_DELETE = 8
+CALL_SET_COUNTER = 9
+CALL_NEXT_COUNTER = 10
+CALL_CHECK_PIN = 11
+
+
+def _map_flash_image(path: str, size: int, persistent: bool) -> mmap.mmap:
+    # MAP_SHARED writes the flash contents through to the image file,
+    # MAP_PRIVATE keeps the changes in the process only
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        if os.fstat(fd).st_size == 0:
+            os.ftruncate(fd, size)
+        if os.fstat(fd).st_size != size:
+            raise RuntimeError("Failed to map flash image due to length mismatch.")
+        flags = mmap.MAP_SHARED if persistent else mmap.MAP_PRIVATE
+        return mmap.mmap(fd, size, flags=flags)
+    finally:
+        os.close(fd)
+
 
 class Storage:
-    def __init__(self) -> None:
-        self.lib = c.cdll.LoadLibrary(fname)
+    def __init__(self, flash_image: str = None, persistent: bool = False) -> None:
+        self.lib = _acquire_lib()
+        weakref.finalize(self, _release_lib, self.lib)
+        # pooled libraries keep the emulator state of their previous instance
+        self.lib.flash_reset()
         self.flash_size = c.cast(self.lib.FLASH_SIZE, c.POINTER(c.c_uint32))[0]
-        self.flash_buffer = c.create_string_buffer(self.flash_size)
+        if flash_image is None:
+            self.flash_buffer = c.create_string_buffer(self.flash_size)
+        else:
+            self.flash_map = _map_flash_image(flash_image, self.flash_size, persistent)
+            self.flash_buffer = (c.c_char * self.flash_size).from_buffer(self.flash_map)
         c.cast(self.lib.FLASH_BUFFER, c.POINTER(c.c_void_p))[0] = c.addressof(self.flash_buffer)
+        self.lib.flash_snapshot_dirty()
+        self.lib.kdf_cache_enable(sectrue if _kdf_cache else 0)
+        self.lib.flash_clock_us.restype = c.c_uint64
+        self.lib.flash_digest.restype = c.c_uint64
+        self.lib.flash_page_digest.restype = c.c_uint64
+        self.call_trace = None
 
     def init(self, salt: bytes) -> None:
+        self._record(CALL_INIT, data=salt)
         self.lib.storage_init(0, salt, c.c_uint16(len(salt)))
 
     def wipe(self) -> None:
+        self._record(CALL_WIPE)
         self.lib.storage_wipe()
 
     def unlock(self, pin: int) -> bool:
+        self._record(CALL_UNLOCK, arg0=pin)
         return sectrue == self.lib.storage_unlock(c.c_uint32(pin))
 
     def lock(self) -> None:
+        self._record(CALL_LOCK)
         self.lib.storage_lock()
 
     def has_pin(self) -> bool:
@@ -31,9 +179,11 @@ class Storage:
         return self.lib.storage_get_pin_rem()
 
     def change_pin(self, oldpin: int, newpin: int) -> bool:
+        self._record(CALL_CHANGE_PIN, arg0=oldpin, arg1=newpin)
         return sectrue == self.lib.storage_change_pin(c.c_uint32(oldpin), c.c_uint32(newpin))
 
     def get(self, key: int) -> bytes:
+        self._record(CALL_GET, key)
         val_len = c.c_uint16()
         if sectrue != self.lib.storage_get(c.c_uint16(key), None, 0, c.byref(val_len)):
             raise RuntimeError("Failed to find key in storage.")
@@ -42,14 +192,52 @@ class Storage:
             raise RuntimeError("Failed to get value from storage.")
         return s.raw
 
+    def get_many(self, keys) -> list:
+        # values of the keys in one call, None for missing keys
+        keys = list(keys)
+        for key in keys:
+            self._record(CALL_GET, key)
+        # the values of distinct keys fit into one norcow sector
+        unique = list(dict.fromkeys(keys))
+        n = len(unique)
+        buf = c.create_string_buffer(NORCOW_SECTOR_SIZE)
+        vals = (c.c_void_p * n)()
+        lens = (c.c_uint16 * n)()
+        self.lib.storage_get_many(
+            (c.c_uint16 * n)(*unique), c.c_size_t(n), buf, c.c_size_t(len(buf)), vals, lens
+        )
+        found = {
+            key: c.string_at(v, size=l) if v else None
+            for key, v, l in zip(unique, vals, lens)
+        }
+        return [found[key] for key in keys]
+
     def set(self, key: int, val: bytes) -> None:
+        self._record(CALL_SET, key, data=val)
         if sectrue != self.lib.storage_set(c.c_uint16(key), val, c.c_uint16(len(val))):
             raise RuntimeError("Failed to set value in storage.")
 
+    def set_many(self, items) -> None:
+        # items is a sequence of (key, val) pairs, which are passed in one call
+        keys = [key for key, _ in items]
+        vals = [val for _, val in items]
+        for key, val in items:
+            self._record(CALL_SET, key, data=val)
+        n = len(keys)
+        if sectrue != self.lib.storage_set_many(
+            (c.c_uint16 * n)(*keys),
+            (c.c_char_p * n)(*vals),
+            (c.c_uint16 * n)(*map(len, vals)),
+            c.c_size_t(n),
+        ):
+            raise RuntimeError("Failed to set values in storage.")
+
     def set_counter(self, key: int, count: int) -> bool:
+        self._record(CALL_SET_COUNTER, key, count)
         return sectrue == self.lib.storage_set_counter(c.c_uint16(key), c.c_uint32(count))
 
     def next_counter(self, key: int) -> int:
+        self._record(CALL_NEXT_COUNTER, key)
         count = c.c_uint32()
         if sectrue == self.lib.storage_next_counter(c.c_uint16(key), c.byref(count)):
             return count.value
@@ -57,6 +245,7 @@ class Storage:
             return None
 
     def delete(self, key: int) -> bool:
+        self._record(CALL_DELETE, key)
         return sectrue == self.lib.storage_delete(c.c_uint16(key))
 
     def _dump(self) -> bytes:
@@ -70,3 +259,74 @@ class Storage:
         if len(buf) != self.flash_size:
             raise RuntimeError("Failed to set flash buffer due to length mismatch.")
         self.flash_buffer.value = buf
+        self.lib.flash_snapshot_dirty()
+
+    def _snapshot(self) -> int:
+        sid = self.lib.flash_snapshot()
+        if sid < 0:
+            raise RuntimeError("Failed to take flash snapshot.")
+        return sid
+
+    def _restore(self, sid: int) -> None:
+        # the storage has to be initialized again after the flash is restored
+        if sectrue != self.lib.flash_restore(sid):
+            raise RuntimeError("Failed to restore flash snapshot.")
+
+    def _free_snapshot(self, sid: int) -> None:
+        self.lib.flash_snapshot_free(sid)
+
+    def _get_flash_stats(self) -> FlashStats:
+        stats = FlashStats()
+        self.lib.flash_stats_get(c.byref(stats))
+        return stats
+
+    def _reset_flash_stats(self) -> None:
+        self.lib.flash_stats_reset()
+
+    def _get_clock(self) -> int:
+        # virtual time in microseconds spent in flash operations and delays
+        return self.lib.flash_clock_us()
+
+    def _get_flash_timing(self) -> FlashTiming:
+        timing = FlashTiming()
+        self.lib.flash_timing_get(c.byref(timing))
+        return timing
+
+    def _set_flash_timing(self, timing: FlashTiming) -> None:
+        self.lib.flash_timing_set(c.byref(timing))
+
+    def _digest(self) -> list:
+        # digests of the norcow sectors, comparable with python Norcow._digest()
+        return [self.lib.flash_digest(s) for s in NORCOW_SECTORS]
+
+    def _page_digest(self, sector: int, page: int) -> int:
+        return self.lib.flash_page_digest(NORCOW_SECTORS[sector], page)
+
+    def _dirty_pages(self) -> list:
+        pages = (c.c_uint32 * DIGEST_PAGE_COUNT)()
+        result = []
+        for s in NORCOW_SECTORS:
+            count = self.lib.flash_dirty_pages(s, pages, DIGEST_PAGE_COUNT)
+            result.append(list(pages[:count]))
+        return result
+
+    def _trace_start(self, path: str) -> None:
+        if sectrue != self.lib.flash_trace_start(path.encode()):
+            raise RuntimeError("Failed to start flash trace.")
+
+    def _trace_stop(self) -> None:
+        if sectrue != self.lib.flash_trace_stop():
+            raise RuntimeError("Failed to write flash trace.")
+
+    def _call_trace_start(self, path: str) -> None:
+        self.call_trace = open(path, "wb")
+        self.call_trace.write(CALL_TRACE_MAGIC + struct.pack("<I", CALL_TRACE_VERSION))
+
+    def _call_trace_stop(self) -> None:
+        if self.call_trace:
+            self.call_trace.close()
+            self.call_trace = None
+
+    def _record(self, op: int, key: int = 0, arg0: int = 0, arg1: int = 0, data: bytes = b"") -> None:
+        if self.call_trace:
+            self.call_trace.write(struct.pack("<BHIIH", op, key, arg0, arg1, len(data)) + data)
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batch calls on top of the storage API. The storage keeps its norcow
+ * internals private, so unlike the old storage the batches are plain
+ * loops over the single calls. Every set still checks the free space and
+ * may compact on its own, and every get looks up its key separately.
+ */
+
+#include "storage_batch.h"
+#include "storage.h"
+
+secbool storage_get_many(const uint16_t *keys, size_t count, uint8_t *buf, size_t buf_len, const void **vals, uint16_t *lens)
+{
+    secbool r = sectrue;
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        const size_t space = buf_len - used;
+        const uint16_t max_len = space > UINT16_MAX ? UINT16_MAX : space;
+        vals[i] = NULL;
+        lens[i] = 0;
+        if (sectrue != storage_get(keys[i], buf + used, max_len, &lens[i])) {
+            lens[i] = 0;
+            r = secfalse;
+            continue;
+        }
+        vals[i] = buf + used;
+        used += lens[i];
+    }
+    return r;
+}
+
+secbool storage_set_many(const uint16_t *keys, const void *const *vals, const uint16_t *lens, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (sectrue != storage_set(keys[i], vals[i], lens[i])) {
+            return secfalse;
+        }
+    }
+    return sectrue;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORAGE_BATCH_H
+#define STORAGE_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "secbool.h"
+
+/*
+ * Gets count keys with one call. The values are copied one after another
+ * into buf and vals points at them. Keys which are missing, not accessible
+ * or do not fit into buf get a NULL value. Returns sectrue if all keys were
+ * found.
+ */
+secbool storage_get_many(const uint16_t *keys, size_t count, uint8_t *buf, size_t buf_len, const void **vals, uint16_t *lens);
+
+/*
+ * Sets count keys with one call, so that the Python wrapper crosses the
+ * FFI boundary once per batch. Stops at the first failing key.
+ */
+secbool storage_set_many(const uint16_t *keys, const void *const *vals, const uint16_t *lens, size_t count);
+
+#endif
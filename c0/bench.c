@@ -0,0 +1,285 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the storage calls. Measures the throughput and the latency
+ * percentiles of set and get over value sizes and fill levels, of unlock and
+ * change_pin over fill levels, the compaction time over the number of
+ * items and distinct keys, and the init time over the number of live keys
+ * with and without the index summary, and prints them as JSON. The old
+ * storage has no delete or counters.
+ *
+ * Usage: bench [ITERATIONS]
+ *
+ * The fill level is the approximate share of the norcow sector taken by
+ * live filler items before the measured calls start.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "flash.h"
+#include "norcow.h"
+#include "storage.h"
+
+extern uint8_t *FLASH_BUFFER;
+extern const uint32_t FLASH_SIZE;
+
+// norcow prefix of an item
+#define ITEM_OVERHEAD 4
+#define FILLER_LEN 1024
+#define FILLER_APP 0x02
+#define BENCH_APP 0x01
+#define MAX_KEYS 8
+#define PIN 1
+#define INIT_RECENT_ITEMS 64
+
+static const uint16_t value_sizes[] = {0, 1, 16, 64, 256, 1024, 4096, 10000};
+static const uint32_t fill_levels[] = {0, 25, 50, 75};
+
+static uint8_t value[10000];
+static const char *result_sep = "";
+
+static void print_result(const char *op, int value_size, uint32_t fill, bench_samples_t *samples, uint64_t virtual_us)
+{
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+        total_ns += samples->ns[i];
+    }
+    printf("%s\n    {\"op\": \"%s\", ", result_sep, op);
+    if (value_size >= 0) {
+        printf("\"value_size\": %d, ", value_size);
+    }
+    printf("\"fill\": %u, \"ops_per_sec\": %.1f, \"virtual_us\": %llu, \"latency_ns\": ", fill,
+           total_ns ? samples->count * 1e9 / total_ns : 0.0, (unsigned long long)virtual_us);
+    bench_print_latency(samples);
+    printf("}");
+    result_sep = ",";
+    bench_samples_free(samples);
+}
+
+/*
+ * Wipes the storage and fills the given percentage of the sector with
+ * filler items
+ */
+static void setup(uint32_t fill)
+{
+    storage_wipe();
+    storage_init(NULL);
+    if (sectrue != storage_unlock(PIN)) {
+        fprintf(stderr, "Failed to unlock the storage\n");
+        exit(1);
+    }
+    const uint32_t count = NORCOW_SECTOR_SIZE / 100 * fill / (FILLER_LEN + ITEM_OVERHEAD);
+    for (uint32_t i = 0; i < count; i++) {
+        if (sectrue != storage_set((FILLER_APP << 8) | i, value, FILLER_LEN)) {
+            fprintf(stderr, "Failed to fill the storage\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Number of keys the measured values rotate over, so that they fit into
+ * a quarter of the free space
+ */
+static uint32_t working_keys(uint32_t fill, uint16_t size)
+{
+    const uint32_t space = NORCOW_SECTOR_SIZE / 100 * (100 - fill) / 4;
+    const uint32_t keys = space / (size + ITEM_OVERHEAD);
+    return keys < 1 ? 1 : keys > MAX_KEYS ? MAX_KEYS : keys;
+}
+
+static void bench_values(uint32_t fill, uint16_t size, uint32_t iterations)
+{
+    bench_samples_t set = {0}, get = {0};
+    uint64_t set_us = 0, get_us = 0;
+    const void *val;
+    uint16_t len;
+    const uint32_t keys = working_keys(fill, size);
+
+    setup(fill);
+    for (uint32_t i = 0; i < iterations; i++) {
+        const uint16_t key = (BENCH_APP << 8) | (i % keys);
+        memset(value, i, size);
+        uint64_t clock = flash_clock_us();
+        uint64_t start = bench_now_ns();
+        const secbool r = storage_set(key, value, size);
+        bench_sample(&set, bench_now_ns() - start);
+        set_us += flash_clock_us() - clock;
+        if (sectrue != r) {
+            fprintf(stderr, "storage_set failed\n");
+            exit(1);
+        }
+
+        clock = flash_clock_us();
+        start = bench_now_ns();
+        (void)storage_get(key, &val, &len);
+        bench_sample(&get, bench_now_ns() - start);
+        get_us += flash_clock_us() - clock;
+    }
+    print_result("set", size, fill, &set, set_us);
+    print_result("get", size, fill, &get, get_us);
+}
+
+static void bench_calls(uint32_t fill, uint32_t iterations)
+{
+    bench_samples_t unlock = {0}, change_pin = {0};
+    uint64_t unlock_us = 0, change_pin_us = 0;
+    uint32_t pin = PIN;
+
+    setup(fill);
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t clock = flash_clock_us();
+        uint64_t start = bench_now_ns();
+        (void)storage_unlock(pin);
+        bench_sample(&unlock, bench_now_ns() - start);
+        unlock_us += flash_clock_us() - clock;
+
+        // toggles between two PINs
+        const uint32_t new_pin = pin == PIN ? PIN + 1 : PIN;
+        clock = flash_clock_us();
+        start = bench_now_ns();
+        (void)storage_change_pin(pin, new_pin);
+        bench_sample(&change_pin, bench_now_ns() - start);
+        change_pin_us += flash_clock_us() - clock;
+        pin = new_pin;
+    }
+    print_result("unlock", -1, fill, &unlock, unlock_us);
+    print_result("change_pin", -1, fill, &change_pin, change_pin_us);
+}
+
+/*
+ * Fills the active sector with count items spread over keys distinct keys
+ * and measures the norcow_set which triggers the compaction
+ */
+static uint64_t bench_compact(uint32_t count, uint32_t keys)
+{
+    norcow_wipe();
+    uint32_t val = 0;
+    for (uint32_t i = 0; i < count; i++, val++) {
+        norcow_set(0x0100 + i % keys, &val, sizeof(val));
+    }
+    // every item above takes 8 bytes, fill the rest of the sector with
+    // one blob so that the next set does not fit
+    const uint32_t used = 4 + count * 8;
+    static uint8_t blob[NORCOW_SECTOR_SIZE];
+    if (used + 4 < NORCOW_SECTOR_SIZE) {
+        norcow_set(0x0001, blob, NORCOW_SECTOR_SIZE - used - 4);
+    }
+    const uint64_t start = bench_now_ns();
+    norcow_set(0x0002, &val, sizeof(val));
+    return bench_now_ns() - start;
+}
+
+/*
+ * Sets the given number of live keys, lays them out by a compaction,
+ * appends a few recent items and measures norcow_init
+ */
+static void bench_init(uint32_t keys, secbool summary, uint32_t iterations, const char *sep)
+{
+    static uint8_t blob[4096];
+    norcow_set_index_summary(summary);
+    norcow_wipe();
+    for (uint32_t i = 0; i < keys; i++) {
+        norcow_set(0x0100 + i, &i, sizeof(i));
+    }
+    // overwrite a blob until the sector gets compacted, changing it every
+    // time as equal values are not written again
+    flash_stats_t stats;
+    uint32_t erases = 0;
+    flash_stats_reset();
+    while (erases == 0) {
+        blob[0]++;
+        norcow_set(0x0002, blob, sizeof(blob));
+        flash_stats_get(&stats);
+        for (int i = 0; i < FLASH_SECTOR_COUNT; i++) {
+            erases += stats.erase_count[i];
+        }
+    }
+    for (uint32_t i = 0; i < INIT_RECENT_ITEMS; i++) {
+        norcow_set(0x0100 + i, &i, sizeof(i));
+    }
+    const void *val;
+    uint16_t len;
+    const secbool written = norcow_get(NORCOW_SUMMARY_KEY, &val, &len);
+    if (written != summary) {
+        fprintf(stderr, "The index summary was %s written\n", sectrue == summary ? "not" : "unexpectedly");
+        exit(1);
+    }
+
+    bench_samples_t init = {0};
+    for (uint32_t i = 0; i < iterations; i++) {
+        const uint64_t start = bench_now_ns();
+        norcow_init();
+        bench_sample(&init, bench_now_ns() - start);
+    }
+    printf("%s\n    {\"keys\": %u, \"summary\": %d, \"latency_ns\": ", sep, keys, sectrue == written);
+    bench_print_latency(&init);
+    printf("}");
+    bench_samples_free(&init);
+    norcow_set_index_summary(secfalse);
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    FLASH_BUFFER = malloc(FLASH_SIZE);
+    memset(FLASH_BUFFER, 0xFF, FLASH_SIZE);
+    storage_init(NULL);
+
+    printf("{\n  \"storage\": \"c0\",\n  \"iterations\": %u,\n  \"results\": [", iterations);
+    for (size_t f = 0; f < sizeof(fill_levels) / sizeof(fill_levels[0]); f++) {
+        for (size_t s = 0; s < sizeof(value_sizes) / sizeof(value_sizes[0]); s++) {
+            bench_values(fill_levels[f], value_sizes[s], iterations);
+        }
+        bench_calls(fill_levels[f], iterations);
+    }
+    printf("\n  ],\n  \"compaction\": [");
+
+    static const uint32_t counts[] = {256, 512, 1024, 2048, 4096, 8000};
+    // distinct keys within what the RAM index holds, larger sectors are
+    // covered by test_index_overflow_compaction
+    static const uint32_t keys[] = {1, 64, 512};
+    const char *sep = "";
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+            const uint64_t ns = bench_compact(counts[c], keys[k]);
+            printf("%s\n    {\"items\": %u, \"keys\": %u, \"ns\": %llu}", sep, counts[c], keys[k], (unsigned long long)ns);
+            sep = ",";
+        }
+    }
+    printf("\n  ],\n  \"init\": [");
+
+    // live keys within what the RAM index holds, as the compaction writes
+    // no index summary for more
+    static const uint32_t init_keys[] = {64, 256, 512, 700};
+    sep = "";
+    for (size_t k = 0; k < sizeof(init_keys) / sizeof(init_keys[0]); k++) {
+        bench_init(init_keys[k], secfalse, iterations < 100 ? iterations : 100, sep);
+        sep = ",";
+        bench_init(init_keys[k], sectrue, iterations < 100 ? iterations : 100, sep);
+    }
+    printf("\n  ]\n}\n");
+
+    free(FLASH_BUFFER);
+    return 0;
+}
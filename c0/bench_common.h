@@ -0,0 +1,94 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BENCH_COMMON_H__
+#define __BENCH_COMMON_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Latency samples in nanoseconds
+ */
+typedef struct {
+    uint64_t *ns;
+    size_t count;
+    size_t size;
+} bench_samples_t;
+
+static inline void bench_sample(bench_samples_t *s, uint64_t ns)
+{
+    if (s->count == s->size) {
+        s->size = s->size ? 2 * s->size : 1024;
+        s->ns = realloc(s->ns, s->size * sizeof(uint64_t));
+        if (!s->ns) {
+            abort();
+        }
+    }
+    s->ns[s->count++] = ns;
+}
+
+static inline int bench_cmp(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Returns the p-th percentile (0..100), sorts the samples
+ */
+static inline uint64_t bench_percentile(bench_samples_t *s, double p)
+{
+    if (s->count == 0) {
+        return 0;
+    }
+    qsort(s->ns, s->count, sizeof(uint64_t), bench_cmp);
+    size_t i = (size_t)(p / 100.0 * (s->count - 1) + 0.5);
+    return s->ns[i];
+}
+
+/*
+ * Prints the latency summary of the samples as a JSON object
+ */
+static inline void bench_print_latency(bench_samples_t *s)
+{
+    printf("{\"count\": %zu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}", s->count,
+           (unsigned long long)bench_percentile(s, 50),
+           (unsigned long long)bench_percentile(s, 90),
+           (unsigned long long)bench_percentile(s, 99),
+           (unsigned long long)bench_percentile(s, 100));
+}
+
+static inline void bench_samples_free(bench_samples_t *s)
+{
+    free(s->ns);
+    s->ns = NULL;
+    s->count = s->size = 0;
+}
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * This file is part of the TREZOR project, https://trezor.io/
+ *
+ * Copyright (c) SatoshiLabs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compaction stress benchmark. Fills the storage with live data up to a
+ * given share of the norcow sector, then churns it with one access pattern
+ * until COMPACTIONS compactions happen, and prints every compaction as
+ * JSON: the duration of the call which triggered it, the bytes copied and
+ * the free space left afterwards. The growth of the active sector over the
+ * calls which did not compact is summed up per pattern as appended bytes.
+ *
+ * Usage: bench_compact [COMPACTIONS]
+ *
+ * A call compacts if it erases a sector. The copied bytes are estimated as
+ * the bytes programmed by that call beyond the magic and beyond the bytes
+ * programmed by the previous call which did not compact. The free space is
+ * read from the active sector of the cold generation.
+ *
+ * The generations section runs the patterns which rewrite few keys for
+ * GENERATION_OPS calls each, once with all keys in the cold generation and
+ * once with the pattern keys in the hot one, and prints the bytes copied per
+ * byte programmed by the calls which did not compact and the erases of every
+ * norcow sector.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "flash.h"
+#include "norcow.h"
+#include "storage.h"
+
+extern uint8_t *FLASH_BUFFER;
+extern const uint32_t FLASH_SIZE;
+
+#define NORCOW_MAGIC ((uint32_t)0x5743524e)
+#define NORCOW_MAGIC_LEN 4
+#define ITEM_OVERHEAD 4
+#define FILLER_LEN 1024
+#define FILLER_APP 0x02
+#define MAX_OPS 1000000
+#define GENERATION_OPS 20000
+#define GENERATION_FILL 75
+#define PIN 1
+
+typedef enum {
+    HOT_KEY,     // one small key
+    UNIFORM,     // small values over 32 keys
+    BLOBS,       // large values over 2 keys
+    COUNTERS,    // PIN fail counter updates of storage_unlock
+    BITMAP,      // a counter kept as a bitmap, every call clears one bit
+    SETTINGS,    // 8 settings saved again with unchanged values
+    PATTERN_COUNT
+} pattern_t;
+
+static const char *const pattern_names[PATTERN_COUNT] = {
+    [HOT_KEY] = "hot_key",
+    [UNIFORM] = "uniform",
+    [BLOBS] = "blobs",
+    [COUNTERS] = "counters",
+    [BITMAP] = "bitmap",
+    [SETTINGS] = "settings",
+};
+
+static const uint32_t fill_levels[] = {10, 25, 50, 75, 90, 95, 99};
+
+// the keys written by the hot_key, counters and blobs patterns
+static const uint16_t hot_keys[] = {0x0001, 0x0101, 0x0180, 0x0181};
+static const pattern_t generation_patterns[] = {HOT_KEY, COUNTERS, BLOBS};
+
+static uint8_t value[FILLER_LEN * 2];
+static uint8_t bitmap[64];
+static const uint8_t settings[32] = {1, 2, 3, 4};
+static uint32_t rng = 1;
+
+// the active sector and its used space found by the previous used_space()
+static int used_sector = -1;
+static uint32_t used_offset = 0;
+
+/*
+ * Returns the bytes used in the active sector of the cold generation, or 0
+ * if there is none
+ * Continues the scan of the previous call unless the sector changed, so
+ * used_sector has to be reset after wipes.
+ */
+static uint32_t used_space(void)
+{
+    static const uint8_t sectors[NORCOW_SECTOR_COUNT] = NORCOW_SECTORS;
+    for (int i = 0; i < 2; i++) {
+        const uint32_t *magic = flash_get_address(sectors[i], 0, sizeof(uint32_t));
+        if (magic == NULL || *magic != NORCOW_MAGIC) {
+            continue;
+        }
+        uint32_t offset = used_sector == i ? used_offset : NORCOW_MAGIC_LEN;
+        while (offset + sizeof(uint32_t) <= NORCOW_SECTOR_SIZE) {
+            const uint32_t *prefix = flash_get_address(sectors[i], offset, sizeof(uint32_t));
+            if ((*prefix & 0xFFFF) == 0xFFFF) {
+                break;
+            }
+            offset += sizeof(uint32_t) + (((*prefix >> 16) + 3) & ~3);
+        }
+        used_sector = i;
+        used_offset = offset;
+        return offset;
+    }
+    return 0;
+}
+
+/*
+ * Runs one call of the pattern, returns its status
+ */
+static secbool churn(pattern_t pattern, uint32_t i)
+{
+    rng = rng * 1103515245 + 12345;
+    switch (pattern) {
+    case HOT_KEY:
+        return storage_set(0x0101, &i, sizeof(i));
+    case UNIFORM:
+        memcpy(value, &i, sizeof(i));
+        return storage_set(0x0120 + (rng >> 16) % 32, value, 16);
+    case BLOBS:
+        memset(value, i, sizeof(value));
+        return storage_set(0x0180 + i % 2, value, sizeof(value));
+    case COUNTERS:
+        return storage_unlock(PIN);
+    case BITMAP:
+        // starts over with all bits set once all are cleared
+        if (i % (sizeof(bitmap) * 8) == 0) {
+            memset(bitmap, 0xFF, sizeof(bitmap));
+        }
+        bitmap[i / 8 % sizeof(bitmap)] &= ~(1 << (i % 8));
+        return storage_set(0x0140, bitmap, sizeof(bitmap));
+    case SETTINGS:
+        return storage_set(0x0160 + i % 8, settings, sizeof(settings));
+    default:
+        return secfalse;
+    }
+}
+
+/*
+ * Wipes the storage, writes the working set of the pattern once and fills
+ * the sector with filler items up to fill percent
+ */
+static secbool setup(pattern_t pattern, uint32_t fill)
+{
+    storage_wipe();
+    used_sector = -1;
+    storage_init(NULL);
+    if (sectrue != storage_unlock(PIN)) {
+        return secfalse;
+    }
+    for (uint32_t i = 0; i < 32; i++) {
+        if (sectrue != churn(pattern, i)) {
+            return secfalse;
+        }
+    }
+    const uint32_t target = NORCOW_SECTOR_SIZE / 100 * fill;
+    for (uint16_t key = FILLER_APP << 8; used_space() + ITEM_OVERHEAD < target; key++) {
+        uint32_t len = target - used_space() - ITEM_OVERHEAD;
+        if (len > FILLER_LEN) {
+            len = FILLER_LEN;
+        }
+        if (sectrue != storage_set(key, value, len)) {
+            return secfalse;
+        }
+    }
+    return sectrue;
+}
+
+static uint64_t erase_count(const flash_stats_t *stats)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        count += stats->erase_count[i];
+    }
+    return count;
+}
+
+static void bench_pattern(pattern_t pattern, uint32_t fill, uint32_t compactions)
+{
+    printf("\n    {\"pattern\": \"%s\", \"fill\": %u, ", pattern_names[pattern], fill);
+    if (sectrue != setup(pattern, fill)) {
+        printf("\"error\": \"setup failed\"}");
+        return;
+    }
+
+    bench_samples_t stalls = {0};
+    uint64_t baseline = 0, appended = 0;
+    uint32_t used = used_space();
+    uint32_t ops = 0;
+    const char *error = NULL;
+    printf("\"events\": [");
+    while (stalls.count < compactions && ops < MAX_OPS) {
+        flash_stats_t before, after;
+        flash_stats_get(&before);
+        const uint64_t start = bench_now_ns();
+        const secbool r = churn(pattern, ops);
+        const uint64_t ns = bench_now_ns() - start;
+        flash_stats_get(&after);
+        ops++;
+        if (sectrue != r) {
+            error = "storage full";
+            break;
+        }
+        const uint64_t programmed = after.programmed_bytes - before.programmed_bytes;
+        if (erase_count(&after) == erase_count(&before)) {
+            const uint32_t now = used_space();
+            baseline = programmed;
+            appended += now - used;
+            used = now;
+            continue;
+        }
+        used_sector = -1;
+        used = used_space();
+        const uint64_t overhead = baseline + NORCOW_MAGIC_LEN;
+        printf("%s{\"ns\": %llu, \"bytes_copied\": %llu, \"free_after\": %u}", stalls.count ? ", " : "",
+               (unsigned long long)ns, (unsigned long long)(programmed > overhead ? programmed - overhead : 0),
+               NORCOW_SECTOR_SIZE - used);
+        bench_sample(&stalls, ns);
+    }
+    printf("], \"ops\": %u, \"appended_bytes\": %llu, \"compactions\": %zu, \"stall_ns\": ", ops,
+           (unsigned long long)appended, stalls.count);
+    bench_print_latency(&stalls);
+    if (error) {
+        printf(", \"error\": \"%s\"", error);
+    }
+    printf("}");
+    bench_samples_free(&stalls);
+}
+
+static void bench_generations(pattern_t pattern, secbool hot)
+{
+    static const uint8_t sectors[NORCOW_SECTOR_COUNT] = NORCOW_SECTORS;
+    printf("\n    {\"pattern\": \"%s\", \"hot_keys\": %s, ", pattern_names[pattern],
+           sectrue == hot ? "true" : "false");
+    norcow_set_hot_keys(hot_keys, sectrue == hot ? sizeof(hot_keys) / sizeof(hot_keys[0]) : 0);
+    if (sectrue != setup(pattern, GENERATION_FILL)) {
+        printf("\"error\": \"setup failed\"}");
+        norcow_set_hot_keys(NULL, 0);
+        return;
+    }
+
+    flash_stats_t start;
+    flash_stats_get(&start);
+    uint64_t baseline = 0, written = 0, copied = 0;
+    uint32_t ops = 0;
+    const char *error = NULL;
+    for (; ops < GENERATION_OPS; ops++) {
+        flash_stats_t before, after;
+        flash_stats_get(&before);
+        const secbool r = churn(pattern, ops);
+        flash_stats_get(&after);
+        if (sectrue != r) {
+            error = "storage full";
+            break;
+        }
+        const uint64_t programmed = after.programmed_bytes - before.programmed_bytes;
+        if (erase_count(&after) == erase_count(&before)) {
+            baseline = programmed;
+            written += programmed;
+            continue;
+        }
+        const uint64_t overhead = baseline + NORCOW_MAGIC_LEN;
+        written += baseline;
+        copied += programmed > overhead ? programmed - overhead : 0;
+    }
+    flash_stats_t end;
+    flash_stats_get(&end);
+    printf("\"ops\": %u, \"bytes_written\": %llu, \"bytes_copied\": %llu, \"copied_per_byte\": %.3f, "
+           "\"erases\": {",
+           ops, (unsigned long long)written, (unsigned long long)copied,
+           written ? (double)copied / written : 0.0);
+    for (int i = 0; i < NORCOW_SECTOR_COUNT; i++) {
+        printf("%s\"%u\": %u", i ? ", " : "", sectors[i],
+               end.erase_count[sectors[i]] - start.erase_count[sectors[i]]);
+    }
+    printf("}");
+    if (error) {
+        printf(", \"error\": \"%s\"", error);
+    }
+    printf("}");
+    norcow_set_hot_keys(NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t compactions = argc > 1 ? strtoul(argv[1], NULL, 10) : 10;
+    FLASH_BUFFER = malloc(FLASH_SIZE);
+    memset(FLASH_BUFFER, 0xFF, FLASH_SIZE);
+    storage_init(NULL);
+
+    printf("{\n  \"storage\": \"c0\",\n  \"compactions\": %u,\n  \"results\": [", compactions);
+    const char *sep = "";
+    for (int p = 0; p < PATTERN_COUNT; p++) {
+        for (size_t f = 0; f < sizeof(fill_levels) / sizeof(fill_levels[0]); f++) {
+            printf("%s", sep);
+            bench_pattern(p, fill_levels[f], compactions);
+            sep = ",";
+        }
+    }
+    printf("\n  ],\n  \"generations\": [");
+    sep = "";
+    for (size_t p = 0; p < sizeof(generation_patterns) / sizeof(generation_patterns[0]); p++) {
+        for (int hot = 0; hot < 2; hot++) {
+            printf("%s", sep);
+            bench_generations(generation_patterns[p], hot ? sectrue : secfalse);
+            sep = ",";
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    free(FLASH_BUFFER);
+    return 0;
+}
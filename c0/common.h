@@ -21,9 +21,11 @@
 #define __TREZORHAL_COMMON_H__
 
 #include "secbool.h"
+#include "flash.h"
 
 #define ensure(expr, msg) (((expr) == sectrue) ? (void)0 : (void)1)
 
-#define hal_delay(ms) (void)ms;
+// advances the virtual clock of the flash emulator
+#define hal_delay(ms) flash_clock_advance((uint64_t)(ms) * 1000)
 
 #endif
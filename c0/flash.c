@@ -55,6 +55,43 @@ static const uint32_t FLASH_SECTOR_TABLE[FLASH_SECTOR_COUNT + 1] = {
 const uint32_t FLASH_SIZE = 0x200000;
 uint8_t *FLASH_BUFFER = NULL;
 
+/*
+ * Copy-on-write snapshots of the flash contents.
+ *
+ * flash_images[i] references a saved image equal to the current contents of
+ * sector i, or is NULL if the sector was modified since the last snapshot
+ * or restore. A snapshot copies only the sectors without an image and
+ * shares the others with older snapshots.
+ */
+typedef struct {
+    uint32_t refs;
+    uint8_t data[];
+} flash_image_t;
+
+typedef struct {
+    flash_image_t *sectors[FLASH_SECTOR_COUNT];
+} flash_snapshot_t;
+
+static flash_image_t *flash_images[FLASH_SECTOR_COUNT];
+static const uint8_t *flash_images_buffer = NULL;
+static flash_snapshot_t *flash_snapshots = NULL;
+static int flash_snapshot_count = 0;
+
+static flash_stats_t flash_stats;
+
+// erases and program operations left before the power cut
+static uint64_t flash_power = FLASH_POWER_ON;
+
+#define FLASH_TIMING_DEFAULT { \
+    .byte_program_us = 16, \
+    .word_program_us = 16, \
+    .erase_16k_us = 250000, \
+    .erase_64k_us = 550000, \
+    .erase_128k_us = 1000000, \
+}
+static flash_timing_t flash_timing = FLASH_TIMING_DEFAULT;
+static uint64_t flash_clock = 0;
+
 void flash_init(void)
 {
     assert(FLASH_SIZE == FLASH_SECTOR_TABLE[FLASH_SECTOR_COUNT] - FLASH_SECTOR_TABLE[0]);
@@ -70,7 +107,31 @@ secbool flash_lock(void)
     return sectrue;
 }
 
-const void *flash_get_address(uint8_t sector, uint32_t offset, uint32_t size)
+static void image_release(flash_image_t *image)
+{
+    if (image && --image->refs == 0) {
+        free(image);
+    }
+}
+
+static void mark_dirty(uint8_t sector)
+{
+    image_release(flash_images[sector]);
+    flash_images[sector] = NULL;
+}
+
+/*
+ * Drops the cached images if FLASH_BUFFER was replaced since they were taken
+ */
+static void check_images_buffer(void)
+{
+    if (flash_images_buffer != FLASH_BUFFER) {
+        flash_snapshot_dirty();
+        flash_images_buffer = FLASH_BUFFER;
+    }
+}
+
+static void *flash_address(uint8_t sector, uint32_t offset, uint32_t size)
 {
     if (sector >= FLASH_SECTOR_COUNT) {
         return NULL;
@@ -83,6 +144,30 @@ const void *flash_get_address(uint8_t sector, uint32_t offset, uint32_t size)
     return FLASH_BUFFER + addr - FLASH_SECTOR_TABLE[0];
 }
 
+const void *flash_get_address(uint8_t sector, uint32_t offset, uint32_t size)
+{
+    const void *flash = flash_address(sector, offset, size);
+    if (flash) {
+        flash_stats.read_bytes += size;
+    }
+    return flash;
+}
+
+/*
+ * Accounts one erase or program operation, returns secfalse once the power
+ * is cut
+ */
+static secbool power_use(void)
+{
+    if (flash_power == 0) {
+        return secfalse;
+    }
+    if (flash_power != FLASH_POWER_ON) {
+        flash_power--;
+    }
+    return sectrue;
+}
+
 secbool flash_erase_sectors(const uint8_t *sectors, int len, void (*progress)(int pos, int len))
 {
     if (progress) {
@@ -90,9 +175,21 @@ secbool flash_erase_sectors(const uint8_t *sectors, int len, void (*progress)(in
     }
     for (int i = 0; i < len; i++) {
         const uint8_t sector = sectors[i];
+        if (sectrue != power_use()) {
+            return secfalse;
+        }
         const uint32_t offset = FLASH_SECTOR_TABLE[sector] - FLASH_SECTOR_TABLE[0];
         const uint32_t size = FLASH_SECTOR_TABLE[sector + 1] - FLASH_SECTOR_TABLE[sector];
         memset(FLASH_BUFFER + offset, 0xFF, size);
+        mark_dirty(sector);
+        flash_stats.erase_count[sector]++;
+        if (size <= 16 * 1024) {
+            flash_clock += flash_timing.erase_16k_us;
+        } else if (size <= 64 * 1024) {
+            flash_clock += flash_timing.erase_64k_us;
+        } else {
+            flash_clock += flash_timing.erase_128k_us;
+        }
         if (progress) {
             progress(i + 1, len);
         }
@@ -100,31 +197,214 @@ secbool flash_erase_sectors(const uint8_t *sectors, int len, void (*progress)(in
     return sectrue;
 }
 
-secbool flash_write_byte(uint8_t sector, uint32_t offset, uint8_t data)
+static secbool program_byte(uint8_t *flash, uint8_t data)
 {
-    uint8_t *flash = (uint8_t *)flash_get_address(sector, offset, 1);
-    if (!flash) {
+    if (sectrue != power_use()) {
         return secfalse;
     }
+    flash_stats.byte_writes++;
+    flash_clock += flash_timing.byte_program_us;
     if ((flash[0] & data) != data) {
+        flash_stats.rejected_writes++;
         return secfalse;  // we cannot change zeroes to ones
     }
     flash[0] = data;
+    flash_stats.programmed_bytes += sizeof(data);
     return sectrue;
 }
 
+static secbool program_word(uint32_t *flash, uint32_t data)
+{
+    if (sectrue != power_use()) {
+        return secfalse;
+    }
+    flash_stats.word_writes++;
+    flash_clock += flash_timing.word_program_us;
+    if ((flash[0] & data) != data) {
+        flash_stats.rejected_writes++;
+        return secfalse;  // we cannot change zeroes to ones
+    }
+    flash[0] = data;
+    flash_stats.programmed_bytes += sizeof(data);
+    return sectrue;
+}
+
+secbool flash_write_byte(uint8_t sector, uint32_t offset, uint8_t data)
+{
+    uint8_t *flash = (uint8_t *)flash_address(sector, offset, 1);
+    if (!flash) {
+        return secfalse;
+    }
+    mark_dirty(sector);
+    return program_byte(flash, data);
+}
+
 secbool flash_write_word(uint8_t sector, uint32_t offset, uint32_t data)
 {
     if (offset % 4) {  // we write only at 4-byte boundary
         return secfalse;
     }
-    uint32_t *flash = (uint32_t *)flash_get_address(sector, offset, sizeof(data));
+    uint32_t *flash = (uint32_t *)flash_address(sector, offset, sizeof(data));
     if (!flash) {
         return secfalse;
     }
-    if ((flash[0] & data) != data) {
-        return secfalse;  // we cannot change zeroes to ones
+    mark_dirty(sector);
+    return program_word(flash, data);
+}
+
+secbool flash_write_block(uint8_t sector, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+    uint8_t *flash = (uint8_t *)flash_address(sector, offset, len);
+    if (!flash) {
+        return secfalse;
+    }
+    mark_dirty(sector);
+    uint32_t i = 0;
+    // unaligned head
+    for (; i < len && (offset + i) % 4; i++) {
+        if (sectrue != program_byte(flash + i, data[i])) {
+            return secfalse;
+        }
+    }
+    // aligned words
+    for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (sectrue != program_word((uint32_t *)(flash + i), word)) {
+            return secfalse;
+        }
+    }
+    // unaligned tail
+    for (; i < len; i++) {
+        if (sectrue != program_byte(flash + i, data[i])) {
+            return secfalse;
+        }
     }
-    flash[0] = data;
     return sectrue;
 }
+
+int flash_snapshot(void)
+{
+    check_images_buffer();
+    int id = 0;
+    while (id < flash_snapshot_count && flash_snapshots[id].sectors[0] != NULL) {
+        id++;
+    }
+    if (id == flash_snapshot_count) {
+        const int count = flash_snapshot_count ? 2 * flash_snapshot_count : 16;
+        flash_snapshot_t *snapshots = realloc(flash_snapshots, count * sizeof(flash_snapshot_t));
+        if (!snapshots) {
+            return -1;
+        }
+        memset(snapshots + flash_snapshot_count, 0, (count - flash_snapshot_count) * sizeof(flash_snapshot_t));
+        flash_snapshots = snapshots;
+        flash_snapshot_count = count;
+    }
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        if (flash_images[i] == NULL) {
+            const uint32_t offset = FLASH_SECTOR_TABLE[i] - FLASH_SECTOR_TABLE[0];
+            const uint32_t size = FLASH_SECTOR_TABLE[i + 1] - FLASH_SECTOR_TABLE[i];
+            flash_image_t *image = malloc(sizeof(flash_image_t) + size);
+            if (!image) {
+                return -1;
+            }
+            image->refs = 1;
+            memcpy(image->data, FLASH_BUFFER + offset, size);
+            flash_images[i] = image;
+        }
+    }
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        flash_images[i]->refs++;
+        flash_snapshots[id].sectors[i] = flash_images[i];
+    }
+    return id;
+}
+
+secbool flash_restore(int id)
+{
+    if (id < 0 || id >= flash_snapshot_count || flash_snapshots[id].sectors[0] == NULL) {
+        return secfalse;
+    }
+    check_images_buffer();
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        flash_image_t *image = flash_snapshots[id].sectors[i];
+        if (flash_images[i] == image) {
+            continue;
+        }
+        const uint32_t offset = FLASH_SECTOR_TABLE[i] - FLASH_SECTOR_TABLE[0];
+        const uint32_t size = FLASH_SECTOR_TABLE[i + 1] - FLASH_SECTOR_TABLE[i];
+        memcpy(FLASH_BUFFER + offset, image->data, size);
+        image_release(flash_images[i]);
+        image->refs++;
+        flash_images[i] = image;
+    }
+    return sectrue;
+}
+
+void flash_snapshot_free(int id)
+{
+    if (id < 0 || id >= flash_snapshot_count) {
+        return;
+    }
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        image_release(flash_snapshots[id].sectors[i]);
+        flash_snapshots[id].sectors[i] = NULL;
+    }
+}
+
+void flash_snapshot_dirty(void)
+{
+    for (uint8_t i = 0; i < FLASH_SECTOR_COUNT; i++) {
+        mark_dirty(i);
+    }
+}
+
+void flash_reset(void)
+{
+    for (int id = 0; id < flash_snapshot_count; id++) {
+        flash_snapshot_free(id);
+    }
+    free(flash_snapshots);
+    flash_snapshots = NULL;
+    flash_snapshot_count = 0;
+    flash_snapshot_dirty();
+    flash_stats_reset();
+    flash_power = FLASH_POWER_ON;
+    flash_timing = (flash_timing_t)FLASH_TIMING_DEFAULT;
+    flash_clock = 0;
+}
+
+void flash_stats_reset(void)
+{
+    memset(&flash_stats, 0, sizeof(flash_stats));
+}
+
+void flash_stats_get(flash_stats_t *stats)
+{
+    *stats = flash_stats;
+}
+
+void flash_power_cut(uint64_t ops)
+{
+    flash_power = ops;
+}
+
+void flash_timing_set(const flash_timing_t *timing)
+{
+    flash_timing = *timing;
+}
+
+void flash_timing_get(flash_timing_t *timing)
+{
+    *timing = flash_timing;
+}
+
+uint64_t flash_clock_us(void)
+{
+    return flash_clock;
+}
+
+void flash_clock_advance(uint64_t us)
+{
+    flash_clock += us;
+}
@@ -28,6 +28,13 @@
 
 void flash_init(void);
 
+/*
+ * Restores the emulator state kept besides the flash contents, that is the
+ * default timing, zero counters and clock, no snapshots and the power on,
+ * so that the tests can reuse the library for a new storage.
+ */
+void flash_reset(void);
+
 secbool __wur flash_unlock(void);
 secbool __wur flash_lock(void);
 
@@ -37,5 +44,61 @@ secbool __wur flash_erase_sectors(const uint8_t *sectors, int len, void (*progre
 static inline secbool flash_erase_sector(uint8_t sector) { return flash_erase_sectors(&sector, 1, NULL); }
 secbool __wur flash_write_byte(uint8_t sector, uint32_t offset, uint8_t data);
 secbool __wur flash_write_word(uint8_t sector, uint32_t offset, uint32_t data);
+secbool __wur flash_write_block(uint8_t sector, uint32_t offset, const uint8_t *data, uint32_t len);
+
+/*
+ * Copy-on-write snapshots of the whole flash, used by the tests to fork
+ * the storage state. flash_snapshot() returns the snapshot id, or -1 on
+ * failure. Any RAM state kept on top of the flash must be re-initialized
+ * after flash_restore(). Call flash_snapshot_dirty() after modifying
+ * FLASH_BUFFER directly.
+ */
+int flash_snapshot(void);
+secbool __wur flash_restore(int id);
+void flash_snapshot_free(int id);
+void flash_snapshot_dirty(void);
+
+/*
+ * Flash operation counters of the emulator. Writes are counted per program
+ * operation, including the rejected ones which try to change a zero to
+ * a one. Reads count the bytes requested through flash_get_address().
+ */
+typedef struct {
+    uint32_t erase_count[FLASH_SECTOR_COUNT];
+    uint64_t byte_writes;
+    uint64_t word_writes;
+    uint64_t rejected_writes;
+    uint64_t programmed_bytes;
+    uint64_t read_bytes;
+} flash_stats_t;
+
+void flash_stats_reset(void);
+void flash_stats_get(flash_stats_t *stats);
+
+/*
+ * Power cut of the emulator, used by the tests to simulate a reset. After
+ * ops more erases and program operations the flash ignores all following
+ * ones and fails them. FLASH_POWER_ON lets all of them through again.
+ */
+#define FLASH_POWER_ON UINT64_MAX
+void flash_power_cut(uint64_t ops);
+
+/*
+ * Timing model of the emulator. Every flash operation is charged to a
+ * virtual clock, so the tests can estimate the latency on a device.
+ * The defaults are the typical STM32F4 figures at x32 parallelism.
+ */
+typedef struct {
+    uint32_t byte_program_us;
+    uint32_t word_program_us;
+    uint32_t erase_16k_us;
+    uint32_t erase_64k_us;
+    uint32_t erase_128k_us;
+} flash_timing_t;
+
+void flash_timing_set(const flash_timing_t *timing);
+void flash_timing_get(flash_timing_t *timing);
+uint64_t flash_clock_us(void);
+void flash_clock_advance(uint64_t us);
 
 #endif
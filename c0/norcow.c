@@ -25,11 +25,114 @@
 
 // NRCW = 4e524357
 #define NORCOW_MAGIC      ((uint32_t)0x5743524e)
+// NRCT = 4e524354, sector of items with a trailing commit word
+#define NORCOW_TAIL_MAGIC ((uint32_t)0x5443524e)
 #define NORCOW_MAGIC_LEN  (sizeof(uint32_t))
 
+#if NORCOW_GENERATION_COUNT != 2 || NORCOW_SECTOR_COUNT != 2 * NORCOW_GENERATION_COUNT
+#error "norcow keeps a cold and a hot generation of two sectors each"
+#endif
+
+#define NORCOW_COLD 0
+#define NORCOW_HOT  1
+
 static const uint8_t norcow_sectors[NORCOW_SECTOR_COUNT] = NORCOW_SECTORS;
-static uint8_t norcow_active_sector = 0;
-static uint32_t norcow_active_offset = NORCOW_MAGIC_LEN;
+static const uint32_t norcow_sizes[NORCOW_GENERATION_COUNT] = NORCOW_GENERATION_SIZES;
+
+/*
+ * Record format of every sector. Items of a tail sector end with a copy of
+ * their prefix, written last as a commit word, so that the sector can be
+ * scanned backwards from its free space. Sectors written by a wipe or a
+ * compaction get the format selected by norcow_set_tail_records().
+ */
+static secbool norcow_tail[NORCOW_SECTOR_COUNT];
+static secbool norcow_tail_records = secfalse;
+
+#if NORCOW_SECTOR_SIZE > 0x10000
+#error "the RAM index stores sector offsets in 16 bits"
+#endif
+
+// the RAM index takes new keys up to this count, which keeps the probe
+// sequences short
+#define INDEX_MAX_KEYS (NORCOW_INDEX_SIZE / 4 * 3)
+
+/*
+ * A generation is a pair of sectors, one of them active, which are
+ * compacted into each other independently of the other generation. The
+ * hot generation holds the keys selected by norcow_set_hot_keys(), so that
+ * their churn does not make the compactions copy the cold keys too.
+ */
+typedef struct {
+    uint8_t active_sector;
+    uint32_t active_offset;
+
+    // RAM index of the active sector: an open addressing hash table of the
+    // latest item of every key, whose entries hold the offset of the item in
+    // the upper and the key in the lower half. Zero marks an unused entry,
+    // as offset 0 always holds the magic.
+    uint32_t index[NORCOW_INDEX_SIZE];
+    // whether the RAM index ran out of room, so that keys missing from it
+    // have to be looked for in the active sector
+    secbool index_full;
+    // bytes of the active sector taken by items replaced by a newer item,
+    // as far as the RAM index knows them
+    uint32_t garbage;
+    // number of keys in the RAM index
+    uint32_t key_count;
+
+    // State of the running compaction, which copies the latest item of
+    // every key from the active sector into the next sector. It lives in
+    // RAM only: the next sector gets its magic once all items are copied,
+    // so until then the active sector stays the only valid one, even after
+    // a reset.
+    secbool compacting;
+    // next item of the active sector to be copied
+    uint32_t compact_offset;
+    // first item of a key left out of the RAM index, where the next pass of
+    // the compaction starts, zero if there is none
+    uint32_t compact_next;
+    // first unused offset of the next sector
+    uint32_t compact_offsetw;
+    // first copied item of the next sector, which follows the space
+    // reserved for the index summary
+    uint32_t compact_first;
+    // number of keys the index summary has room for
+    uint32_t compact_summary_keys;
+} norcow_generation_t;
+
+static norcow_generation_t norcow_generations[NORCOW_GENERATION_COUNT];
+
+/*
+ * Keys copied by the running compaction, one bit per key. Only one
+ * compaction runs at a time.
+ */
+static uint32_t norcow_copied[0x10000 / 32];
+
+/*
+ * Keys of the hot generation, one bit per key. The hot generation is used
+ * only if there are any.
+ */
+static uint32_t norcow_hot[0x10000 / 32];
+static secbool norcow_hot_enabled = secfalse;
+
+/*
+ * Whether compactions start the next sector with an index summary, see
+ * write_summary().
+ */
+static secbool norcow_summary = secfalse;
+
+/*
+ * State of the write opened by norcow_set_begin(). Its item is reserved at
+ * the active offset of its generation and the value is programmed behind
+ * the still erased prefix, which is programmed last as the commit word.
+ * Until then the item ends the scans, so a write torn by a reset is never
+ * read.
+ */
+static secbool norcow_streaming = secfalse;
+static uint16_t norcow_stream_key = 0;
+static uint16_t norcow_stream_len = 0;
+// bytes of the value programmed so far
+static uint16_t norcow_stream_pos = 0;
 
 /*
  * Returns pointer to sector, starting with offset
@@ -42,14 +145,14 @@ static const void *norcow_ptr(uint8_t sector, uint32_t offset, uint32_t size)
 }
 
 /*
- * Writes data to given sector, starting from offset
+ * Programs data to given sector, starting from offset
+ * The flash must be unlocked by the caller
  */
-static secbool norcow_write(uint8_t sector, uint32_t offset, uint32_t prefix, const uint8_t *data, uint16_t len)
+static secbool norcow_program(uint8_t sector, uint32_t offset, uint32_t prefix, const uint8_t *data, uint16_t len)
 {
     if (sector >= NORCOW_SECTOR_COUNT) {
         return secfalse;
     }
-    ensure(flash_unlock(), NULL);
 
     // write prefix
     ensure(flash_write_word(norcow_sectors[sector], offset, prefix), NULL);
@@ -57,18 +160,27 @@ static secbool norcow_write(uint8_t sector, uint32_t offset, uint32_t prefix, co
     if (len > 0) {
         offset += sizeof(uint32_t);
         // write data
-        for (uint16_t i = 0; i < len; i++, offset++) {
-            ensure(flash_write_byte(norcow_sectors[sector], offset, data[i]), NULL);
-        }
+        ensure(flash_write_block(norcow_sectors[sector], offset, data, len), NULL);
+        offset += len;
         // pad with zeroes
         for (; offset % 4; offset++) {
             ensure(flash_write_byte(norcow_sectors[sector], offset, 0x00), NULL);
         }
     }
-    ensure(flash_lock(), NULL);
     return sectrue;
 }
 
+/*
+ * Writes data to given sector, starting from offset
+ */
+static secbool norcow_write(uint8_t sector, uint32_t offset, uint32_t prefix, const uint8_t *data, uint16_t len)
+{
+    ensure(flash_unlock(), NULL);
+    secbool r = norcow_program(sector, offset, prefix, data, len);
+    ensure(flash_lock(), NULL);
+    return r;
+}
+
 /*
  * Erases sector (and sets a magic)
  */
@@ -77,12 +189,60 @@ static void norcow_erase(uint8_t sector, secbool set_magic)
     ensure(sectrue * (sector <= NORCOW_SECTOR_COUNT), "invalid sector");
     ensure(flash_erase_sector(norcow_sectors[sector]), "erase failed");
     if (sectrue == set_magic) {
-        ensure(norcow_write(sector, 0, NORCOW_MAGIC, NULL, 0), "set magic failed");
+        norcow_tail[sector] = norcow_tail_records;
+        ensure(norcow_write(sector, 0, sectrue == norcow_tail[sector] ? NORCOW_TAIL_MAGIC : NORCOW_MAGIC, NULL, 0), "set magic failed");
     }
 }
 
+/*
+ * Returns the number of bytes of given sector used by norcow
+ */
+static uint32_t sector_size(uint8_t sector)
+{
+    return norcow_sizes[sector / 2];
+}
+
+/*
+ * Returns the other sector of the generation
+ */
+static uint8_t next_sector(const norcow_generation_t *g)
+{
+    return g->active_sector ^ 1;
+}
+
+/*
+ * Returns the generation of the key
+ */
+static norcow_generation_t *key_generation(uint16_t key)
+{
+    const secbool hot = sectrue * ((norcow_hot[key / 32] & (1U << (key % 32))) != 0);
+    return &norcow_generations[sectrue == hot ? NORCOW_HOT : NORCOW_COLD];
+}
+
+/*
+ * Returns the number of generations in use
+ */
+static uint8_t generation_count(void)
+{
+    return sectrue == norcow_hot_enabled ? NORCOW_GENERATION_COUNT : 1;
+}
+
 #define ALIGN4(X) (X) = ((X) + 3) & ~3
 
+/*
+ * Returns the number of bytes an item with data of given length takes
+ * in given sector
+ */
+static uint32_t item_size(uint8_t sector, uint16_t len)
+{
+    uint32_t size = sizeof(uint32_t) + len;
+    ALIGN4(size);
+    if (sectrue == norcow_tail[sector]) {
+        size += sizeof(uint32_t);
+    }
+    return size;
+}
+
 /*
  * Reads one item starting from offset
  */
@@ -107,28 +267,74 @@ static secbool read_item(uint8_t sector, uint32_t offset, uint16_t *key, const v
     if (*val == NULL) return secfalse;
     *pos += *len;
     ALIGN4(*pos);
+
+    // an item without its commit word was not completely written
+    if (sectrue == norcow_tail[sector]) {
+        const uint32_t *t = norcow_ptr(sector, *pos, sizeof(uint32_t));
+        if (t == NULL || *t != (((uint32_t)*len << 16) | *key)) {
+            return secfalse;
+        }
+        *pos += sizeof(uint32_t);
+    }
     return sectrue;
 }
 
+/*
+ * Programs one item starting from offset, the flash must be unlocked
+ */
+static secbool program_item(uint8_t sector, uint32_t offset, uint16_t key, const void *val, uint16_t len, uint32_t *pos)
+{
+    uint32_t prefix = (len << 16) | key;
+    *pos = offset + item_size(sector, len);
+    secbool r = norcow_program(sector, offset, prefix, val, len);
+    if (sectrue == r && sectrue == norcow_tail[sector]) {
+        // commit the item
+        ensure(flash_write_word(norcow_sectors[sector], *pos - sizeof(uint32_t), prefix), NULL);
+    }
+    return r;
+}
+
+/*
+ * Commits an item at offset whose value is programmed already, by
+ * programming its padding, its prefix and in a tail sector the trailing
+ * commit word, the flash must be unlocked
+ *
+ * Until the prefix is programmed, the item ends the scans and its value
+ * shows up as programmed words behind the valid items, which a reset
+ * leaves for the next init to move away from.
+ */
+static void commit_item(uint8_t sector, uint32_t offset, uint16_t key, uint16_t len)
+{
+    const uint32_t prefix = ((uint32_t)len << 16) | key;
+    // pad with zeroes
+    for (uint32_t pad = offset + sizeof(uint32_t) + len; pad % 4; pad++) {
+        ensure(flash_write_byte(norcow_sectors[sector], pad, 0x00), NULL);
+    }
+    ensure(flash_write_word(norcow_sectors[sector], offset, prefix), NULL);
+    if (sectrue == norcow_tail[sector]) {
+        ensure(flash_write_word(norcow_sectors[sector], offset + item_size(sector, len) - sizeof(uint32_t), prefix), NULL);
+    }
+}
+
 /*
  * Writes one item starting from offset
  */
 static secbool write_item(uint8_t sector, uint32_t offset, uint16_t key, const void *val, uint16_t len, uint32_t *pos)
 {
-    uint32_t prefix = (len << 16) | key;
-    *pos = offset + sizeof(uint32_t) + len;
-    ALIGN4(*pos);
-    return norcow_write(sector, offset, prefix, val, len);
+    ensure(flash_unlock(), NULL);
+    secbool r = program_item(sector, offset, key, val, len, pos);
+    ensure(flash_lock(), NULL);
+    return r;
 }
 
 /*
- * Finds item in given sector
+ * Finds item in given sector, scanning forward from its first item at start
  */
-static secbool find_item(uint8_t sector, uint16_t key, const void **val, uint16_t *len)
+static secbool find_item_forward(uint8_t sector, uint32_t start, uint16_t key, const void **val, uint16_t *len)
 {
     *val = 0;
     *len = 0;
-    uint32_t offset = NORCOW_MAGIC_LEN;
+    uint32_t offset = start;
     for (;;) {
         uint16_t k, l;
         const void *v;
@@ -146,11 +352,113 @@ static secbool find_item(uint8_t sector, uint16_t key, const void **val, uint16_
 }
 
 /*
- * Finds first unused offset in given sector
+ * Finds item in given sector whose items span from start to end
+ *
+ * Items of a tail sector are scanned backwards from the end using their
+ * commit words, so the scan stops at the latest item of the key.
+ */
+static secbool find_item(uint8_t sector, uint32_t start, uint32_t end, uint16_t key, const void **val, uint16_t *len)
+{
+    if (sectrue != norcow_tail[sector]) {
+        return find_item_forward(sector, start, key, val, len);
+    }
+    *val = 0;
+    *len = 0;
+    uint32_t offset = end;
+    while (offset > start) {
+        const uint32_t *t = norcow_ptr(sector, offset - sizeof(uint32_t), sizeof(uint32_t));
+        if (t == NULL) {
+            break;
+        }
+        const uint32_t size = item_size(sector, *t >> 16);
+        uint16_t k, l;
+        uint32_t pos;
+        if (size > offset - start ||
+            sectrue != read_item(sector, offset - size, &k, val, &l, &pos) || pos != offset) {
+            // not a chain of committed items
+            return find_item_forward(sector, start, key, val, len);
+        }
+        if (key == k) {
+            *len = l;
+            return sectrue;
+        }
+        offset -= size;
+    }
+    *val = 0;
+    return secfalse;
+}
+
+/*
+ * Returns whether given sector is erased from offset to its end
+ */
+static secbool is_erased(uint8_t sector, uint32_t offset)
+{
+    const uint32_t size = sector_size(sector);
+    const uint32_t *w = norcow_ptr(sector, offset, size - offset);
+    if (w == NULL) {
+        return secfalse;
+    }
+    for (uint32_t i = 0; i < (size - offset) / sizeof(uint32_t); i++) {
+        if (w[i] != 0xFFFFFFFF) {
+            return secfalse;
+        }
+    }
+    return sectrue;
+}
+
+/*
+ * Returns the entry of the RAM index of the generation which holds the key,
+ * or the unused entry where it belongs if there is none
+ */
+static uint32_t index_slot(const norcow_generation_t *g, uint16_t key)
+{
+    // Fibonacci hashing, the keys of an APP differ in their low bits
+    uint32_t slot = ((uint32_t)(uint16_t)(key * 40503U) * NORCOW_INDEX_SIZE) >> 16;
+    while (g->index[slot] != 0 && (g->index[slot] & 0xFFFF) != key) {
+        slot = (slot + 1) % NORCOW_INDEX_SIZE;
+    }
+    return slot;
+}
+
+/*
+ * Returns the offset of the latest item of the key according to the RAM
+ * index of the generation, zero if it does not hold the key
  */
-static uint32_t find_free_offset(uint8_t sector)
+static uint32_t index_get(const norcow_generation_t *g, uint16_t key)
+{
+    return g->index[index_slot(g, key)] >> 16;
+}
+
+/*
+ * Points the RAM index of the generation to a new item of the key in given
+ * sector and accounts the item it replaces as garbage
+ */
+static void index_item(norcow_generation_t *g, uint8_t sector, uint16_t key, uint32_t offset)
+{
+    const uint32_t slot = index_slot(g, key);
+    const uint32_t old = g->index[slot] >> 16;
+    if (old != 0) {
+        uint16_t k, l;
+        const void *v;
+        uint32_t pos;
+        if (sectrue == read_item(sector, old, &k, &v, &l, &pos)) {
+            g->garbage += pos - old;
+        }
+    } else if (g->key_count < INDEX_MAX_KEYS) {
+        g->key_count++;
+    } else {
+        g->index_full = sectrue;
+        return;
+    }
+    g->index[slot] = (offset << 16) | key;
+}
+
+/*
+ * Adds the items of given sector from offset on to the RAM index of the
+ * generation, returns first unused offset
+ */
+static uint32_t scan_index(norcow_generation_t *g, uint8_t sector, uint32_t offset)
 {
-    uint32_t offset = NORCOW_MAGIC_LEN;
     for (;;) {
         uint16_t key, len;
         const void *val;
@@ -158,89 +466,585 @@ static uint32_t find_free_offset(uint8_t sector)
         if (sectrue != read_item(sector, offset, &key, &val, &len, &pos)) {
             break;
         }
+        index_item(g, sector, key, offset);
         offset = pos;
     }
     return offset;
 }
 
 /*
- * Compacts active sector and sets new active sector
+ * Clears the RAM index of the generation
  */
-static void compact()
+static void clear_index(norcow_generation_t *g)
 {
-    uint8_t norcow_next_sector = (norcow_active_sector + 1) % NORCOW_SECTOR_COUNT;
-    norcow_erase(norcow_next_sector, sectrue);
+    memset(g->index, 0, sizeof(g->index));
+    g->index_full = secfalse;
+    g->garbage = 0;
+    g->key_count = 0;
+}
 
-    uint32_t offset = NORCOW_MAGIC_LEN, offsetw = NORCOW_MAGIC_LEN;
+/*
+ * Rebuilds the RAM index of the generation from given sector, returns first
+ * unused offset
+ */
+static uint32_t build_index(norcow_generation_t *g, uint8_t sector)
+{
+    clear_index(g);
+    return scan_index(g, sector, NORCOW_MAGIC_LEN);
+}
 
-    for (;;) {
-        // read item
+/*
+ * The index summary is the first item of a sector written by a compaction.
+ * Its data are the offset following the items it covers, the garbage bytes
+ * among them and one word per covered key with the offset of its latest
+ * item in the upper and the key in the lower half. Unused words are zero.
+ * Items appended after the covered ones are scanned as usual.
+ */
+#define SUMMARY_HEADER_WORDS 2
+#define SUMMARY_MAX_KEYS (0xFFFF / sizeof(uint32_t) - SUMMARY_HEADER_WORDS)
+
+/*
+ * Loads the RAM index of the generation from the index summary of given
+ * sector and scans the items appended after it, returns first unused offset
+ * Falls back to building the index from all items without a valid summary
+ */
+static uint32_t load_index(norcow_generation_t *g, uint8_t sector)
+{
+    uint16_t key, len;
+    const void *val;
+    uint32_t first;
+    if (sectrue != read_item(sector, NORCOW_MAGIC_LEN, &key, &val, &len, &first) ||
+        key != NORCOW_SUMMARY_KEY || len < SUMMARY_HEADER_WORDS * sizeof(uint32_t) || len % sizeof(uint32_t)) {
+        return build_index(g, sector);
+    }
+    uint32_t words[SUMMARY_HEADER_WORDS];
+    memcpy(words, val, sizeof(words));
+    const uint32_t covered = words[0];
+    if (covered < first || covered > sector_size(sector) || covered % sizeof(uint32_t)) {
+        return build_index(g, sector);
+    }
+
+    clear_index(g);
+    index_item(g, sector, key, NORCOW_MAGIC_LEN);
+    for (uint32_t i = SUMMARY_HEADER_WORDS; i < len / sizeof(uint32_t); i++) {
+        uint32_t entry;
+        memcpy(&entry, (const uint8_t *)val + i * sizeof(uint32_t), sizeof(entry));
+        if (entry == 0) {
+            continue;
+        }
+        const uint16_t k = entry & 0xFFFF;
+        const uint32_t offset = entry >> 16;
+        // the prefix of the item has to match the entry
+        const uint16_t *prefix = norcow_ptr(sector, offset, sizeof(uint16_t));
+        if (offset < first || offset >= covered || offset % sizeof(uint32_t) ||
+            prefix == NULL || *prefix != k || index_get(g, k) != 0) {
+            return build_index(g, sector);
+        }
+        index_item(g, sector, k, offset);
+    }
+    g->garbage = words[1];
+    return scan_index(g, sector, covered);
+}
+
+/*
+ * Writes the index summary of the items of the next sector reserved by the
+ * compaction, to be called once all of them are copied
+ *
+ * The latest items are found by rebuilding the RAM index from the next
+ * sector. If keys were added during the compaction, the summary covers
+ * the items up to the first latest item it has no room for, or up to the
+ * first item of a key the RAM index has no room for.
+ */
+static void write_summary(norcow_generation_t *g, uint8_t sector)
+{
+    const uint32_t first = g->compact_first, end = g->compact_offsetw;
+    clear_index(g);
+    scan_index(g, sector, first);
+
+    // find the covered items and their garbage
+    uint32_t covered = end, live = 0, keys = 0;
+    for (uint32_t offset = first; offset < end;) {
         uint16_t k, l;
         const void *v;
         uint32_t pos;
-        secbool r = read_item(norcow_active_sector, offset, &k, &v, &l, &pos);
-        if (sectrue != r) {
+        ensure(read_item(sector, offset, &k, &v, &l, &pos), "summary scan failed");
+        const uint32_t latest = index_get(g, k);
+        if (latest == 0) {
+            covered = offset;
             break;
         }
+        if (latest == offset) {
+            if (keys == g->compact_summary_keys) {
+                covered = offset;
+                break;
+            }
+            keys++;
+            live += pos - offset;
+        }
         offset = pos;
+    }
 
-        // check if not already saved
-        const void *v2;
-        uint16_t l2;
-        r = find_item(norcow_next_sector, k, &v2, &l2);
-        if (sectrue == r) {
-            continue;
+    const uint16_t len = (SUMMARY_HEADER_WORDS + g->compact_summary_keys) * sizeof(uint32_t);
+    const uint32_t prefix = ((uint32_t)len << 16) | NORCOW_SUMMARY_KEY;
+    const uint8_t flash_sector = norcow_sectors[sector];
+    uint32_t w = NORCOW_MAGIC_LEN;
+    ensure(flash_unlock(), NULL);
+    ensure(flash_write_word(flash_sector, w, prefix), NULL);
+    ensure(flash_write_word(flash_sector, w += sizeof(uint32_t), covered), NULL);
+    ensure(flash_write_word(flash_sector, w += sizeof(uint32_t), covered - first - live), NULL);
+    for (uint32_t offset = first; offset < covered;) {
+        uint16_t k, l;
+        const void *v;
+        uint32_t pos;
+        ensure(read_item(sector, offset, &k, &v, &l, &pos), "summary scan failed");
+        if (index_get(g, k) == offset) {
+            ensure(flash_write_word(flash_sector, w += sizeof(uint32_t), (offset << 16) | k), NULL);
         }
+        offset = pos;
+    }
+    // clear the unused entries
+    for (w += sizeof(uint32_t); w < NORCOW_MAGIC_LEN + sizeof(uint32_t) + len; w += sizeof(uint32_t)) {
+        ensure(flash_write_word(flash_sector, w, 0), NULL);
+    }
+    if (sectrue == norcow_tail[sector]) {
+        ensure(flash_write_word(flash_sector, w, prefix), NULL);
+    }
+    ensure(flash_lock(), NULL);
+}
 
-        // scan for latest instance
-        uint32_t offsetr = offset;
-        for (;;) {
-            uint16_t k2;
-            uint32_t posr;
-            r = read_item(norcow_active_sector, offsetr, &k2, &v2, &l2, &posr);
-            if (sectrue != r) {
+/*
+ * Finds item in the active sector of the generation using its RAM index
+ * Falls back to a full scan if the index does not match the flash contents
+ * or has no room for the key
+ */
+static secbool lookup_item(const norcow_generation_t *g, uint16_t key, const void **val, uint16_t *len)
+{
+    *val = 0;
+    *len = 0;
+    const uint32_t offset = index_get(g, key);
+    if (offset == 0) {
+        if (sectrue == g->index_full) {
+            return find_item(g->active_sector, NORCOW_MAGIC_LEN, g->active_offset, key, val, len);
+        }
+        return secfalse;
+    }
+    uint16_t k;
+    uint32_t pos;
+    if (sectrue != read_item(g->active_sector, offset, &k, val, len, &pos) || k != key) {
+        return find_item(g->active_sector, NORCOW_MAGIC_LEN, g->active_offset, key, val, len);
+    }
+    return sectrue;
+}
+
+/*
+ * Returns whether the running compaction of the generation already copied
+ * the key
+ */
+static secbool compact_copied(const norcow_generation_t *g, uint16_t key)
+{
+    return sectrue * (sectrue == g->compacting && (norcow_copied[key / 32] & (1U << (key % 32))) != 0);
+}
+
+/*
+ * Returns whether the generation holds the key
+ */
+static secbool holds_key(const norcow_generation_t *g, uint16_t key)
+{
+    const void *v;
+    uint16_t l;
+    return lookup_item(g, key, &v, &l);
+}
+
+/*
+ * Returns whether the compaction of the generation keeps the key. Keys of
+ * the other generation, left behind when the hot keys changed, are dropped
+ * once the other generation holds them.
+ */
+static secbool keeps_key(const norcow_generation_t *g, uint16_t key)
+{
+    const norcow_generation_t *owner = key_generation(key);
+    return sectrue * (owner == g || sectrue != holds_key(owner, key));
+}
+
+/*
+ * Starts a compaction of the generation into its next sector
+ */
+static secbool compact_step(norcow_generation_t *g, uint32_t budget);
+
+static void compact_start(norcow_generation_t *g)
+{
+    // the compactions share the bitmap of copied keys, finish the one of
+    // the other generation first
+    for (uint8_t n = 0; n < NORCOW_GENERATION_COUNT; n++) {
+        if (&norcow_generations[n] != g && sectrue == norcow_generations[n].compacting) {
+            compact_step(&norcow_generations[n], UINT32_MAX);
+        }
+    }
+
+    const uint8_t norcow_next_sector = next_sector(g);
+    norcow_erase(norcow_next_sector, secfalse);
+
+    build_index(g, g->active_sector);
+    memset(norcow_copied, 0, sizeof(norcow_copied));
+    g->compact_offset = NORCOW_MAGIC_LEN;
+    g->compact_offsetw = NORCOW_MAGIC_LEN;
+    g->compact_next = 0;
+
+    // bytes taken by the latest items in the active sector
+    const uint32_t space = sector_size(norcow_next_sector) - NORCOW_MAGIC_LEN;
+    uint32_t keys = g->key_count - (index_get(g, NORCOW_SUMMARY_KEY) != 0 ? 1 : 0);
+    uint32_t live = g->active_offset - NORCOW_MAGIC_LEN - g->garbage;
+
+    // the compaction changes the sector to the selected record format,
+    // unless the items would not fit, which is not known without a RAM
+    // index of all keys
+    norcow_tail[norcow_next_sector] = norcow_tail_records;
+    if (sectrue == g->index_full) {
+        norcow_tail[norcow_next_sector] = norcow_tail[g->active_sector];
+    } else if (norcow_tail_records != norcow_tail[g->active_sector]) {
+        const uint32_t resized = sectrue == norcow_tail_records ? live + keys * sizeof(uint32_t) : live - keys * sizeof(uint32_t);
+        if (resized > space) {
+            norcow_tail[norcow_next_sector] = norcow_tail[g->active_sector];
+        } else {
+            live = resized;
+        }
+    }
+
+    // reserve room for the index summary if it fits too
+    g->compact_summary_keys = 0;
+    if (sectrue == norcow_summary && sectrue != g->index_full) {
+        keys = keys > SUMMARY_MAX_KEYS ? SUMMARY_MAX_KEYS : keys;
+        const uint32_t size = item_size(norcow_next_sector, (SUMMARY_HEADER_WORDS + keys) * sizeof(uint32_t));
+        if (live + size <= space) {
+            g->compact_summary_keys = keys;
+            g->compact_offsetw += size;
+        }
+    }
+    g->compact_first = g->compact_offsetw;
+    g->compacting = sectrue;
+}
+
+/*
+ * Starts the next pass of the running compaction of the generation, which
+ * rebuilds the RAM index from the keys not copied yet, beginning with the
+ * first item left out by the previous pass
+ *
+ * The RAM index stays marked as full, as it lacks the copied keys.
+ */
+static void compact_pass(norcow_generation_t *g)
+{
+    uint32_t offset = g->compact_next;
+    clear_index(g);
+    g->compact_offset = offset;
+    g->compact_next = 0;
+    for (;;) {
+        uint16_t k, l;
+        const void *v;
+        uint32_t pos;
+        if (sectrue != read_item(g->active_sector, offset, &k, &v, &l, &pos)) {
+            break;
+        }
+        if (sectrue != compact_copied(g, k) && k != NORCOW_SUMMARY_KEY) {
+            index_item(g, g->active_sector, k, offset);
+        }
+        offset = pos;
+    }
+    g->index_full = sectrue;
+}
+
+/*
+ * Copies at most budget items of the running compaction of the generation,
+ * returns sectrue once the compaction is finished and the next sector
+ * became active
+ *
+ * The RAM index holds the latest item of every key, which is copied when
+ * the first item of its key is reached. This keeps the keys in the order
+ * of their first appearance. Keys the RAM index has no room for are left
+ * for further passes over the rest of the active sector, each with the
+ * RAM index rebuilt from the keys not copied yet, so that no key is looked
+ * up by a scan. Items set during the compaction are either reached later
+ * or mirrored into the next sector by the setter. A compaction which
+ * cannot copy an item is dropped and leaves the active sector as it is.
+ */
+static secbool compact_step(norcow_generation_t *g, uint32_t budget)
+{
+    const uint8_t norcow_next_sector = next_sector(g);
+
+    for (; budget > 0; budget--) {
+        // read item
+        uint16_t k, l;
+        const void *v;
+        uint32_t pos;
+        secbool r = read_item(g->active_sector, g->compact_offset, &k, &v, &l, &pos);
+        if (sectrue != r) {
+            if (g->compact_next == 0) {
                 break;
             }
-            if (k == k2) {
-                v = v2;
-                l = l2;
+            compact_pass(g);
+            continue;
+        }
+        const uint32_t offset = g->compact_offset;
+        g->compact_offset = pos;
+
+        // check if not already saved, the index summary gets rewritten
+        if (sectrue == compact_copied(g, k) || k == NORCOW_SUMMARY_KEY || sectrue != keeps_key(g, k)) {
+            continue;
+        }
+        if (index_get(g, k) == 0 && sectrue == g->index_full) {
+            // copied by a later pass
+            if (g->compact_next == 0) {
+                g->compact_next = offset;
             }
-            offsetr = posr;
+            continue;
+        }
+        norcow_copied[k / 32] |= 1U << (k % 32);
+
+        // read latest instance, an index which does not match the flash
+        // contents falls back to a scan, which finds at least the item just
+        // read unless the sector changed under the compaction
+        if (sectrue != lookup_item(g, k, &v, &l) &&
+            sectrue != find_item(g->active_sector, NORCOW_MAGIC_LEN, g->active_offset, k, &v, &l)) {
+            g->compacting = secfalse;
+            return secfalse;
         }
 
-        // copy the last item
+        // copy the last item, items mirrored meanwhile may have taken
+        // the space it needs
+        if (g->compact_offsetw + item_size(norcow_next_sector, l) > sector_size(norcow_next_sector)) {
+            g->compacting = secfalse;
+            return secfalse;
+        }
         uint32_t posw;
-        ensure(write_item(norcow_next_sector, offsetw, k, v, l, &posw), "compaction write failed");
-        offsetw = posw;
+        if (sectrue != write_item(norcow_next_sector, g->compact_offsetw, k, v, l, &posw)) {
+            g->compacting = secfalse;
+            return secfalse;
+        }
+        g->compact_offsetw = posw;
+    }
+    if (budget == 0) {
+        return secfalse;
     }
 
-    norcow_erase(norcow_active_sector, secfalse);
-    norcow_active_sector = norcow_next_sector;
-    norcow_active_offset = find_free_offset(norcow_active_sector);
+    // all items are copied, commit the next sector
+    if (g->compact_summary_keys > 0) {
+        write_summary(g, norcow_next_sector);
+        index_item(g, norcow_next_sector, NORCOW_SUMMARY_KEY, NORCOW_MAGIC_LEN);
+        g->active_offset = g->compact_offsetw;
+    } else {
+        g->active_offset = build_index(g, norcow_next_sector);
+    }
+    ensure(norcow_write(norcow_next_sector, 0, sectrue == norcow_tail[norcow_next_sector] ? NORCOW_TAIL_MAGIC : NORCOW_MAGIC, NULL, 0), "set magic failed");
+    norcow_erase(g->active_sector, secfalse);
+    g->active_sector = norcow_next_sector;
+    g->compacting = secfalse;
+    return sectrue;
 }
 
 /*
- * Initializes storage
+ * Compacts the active sector of the generation and sets its new active
+ * sector, finishing the running compaction if there is one
  */
-void norcow_init(void)
+static void compact(norcow_generation_t *g)
 {
-    flash_init();
-    secbool found = secfalse;
-    // detect active sector - starts with magic
-    for (uint8_t i = 0; i < NORCOW_SECTOR_COUNT; i++) {
+    if (sectrue == g->compacting && sectrue == compact_step(g, UINT32_MAX)) {
+        return;
+    }
+    // none is running or the running one ran out of space, start over
+    compact_start(g);
+    compact_step(g, UINT32_MAX);
+}
+
+/*
+ * Programs an item set during the running compaction of the generation also
+ * into its next sector if its key was already copied, the flash must be
+ * unlocked
+ */
+static void mirror_item(norcow_generation_t *g, uint16_t key, const void *val, uint16_t len)
+{
+    if (sectrue != compact_copied(g, key)) {
+        return;
+    }
+    const uint8_t norcow_next_sector = next_sector(g);
+    if (g->compact_offsetw + item_size(norcow_next_sector, len) > sector_size(norcow_next_sector)) {
+        // the next sector is full, a new compaction has to start over
+        g->compacting = secfalse;
+        return;
+    }
+    uint32_t pos;
+    ensure(program_item(norcow_next_sector, g->compact_offsetw, key, val, len, &pos), "mirror write failed");
+    g->compact_offsetw = pos;
+}
+
+/*
+ * Erases both sectors of the generation starting at given sector, sets the
+ * magic of the first one and clears the RAM state
+ */
+static void wipe_generation(norcow_generation_t *g, uint8_t first)
+{
+    norcow_erase(first, sectrue);
+    norcow_erase(first + 1, secfalse);
+    g->active_sector = first;
+    g->active_offset = NORCOW_MAGIC_LEN;
+    clear_index(g);
+    g->compacting = secfalse;
+}
+
+/*
+ * Detects the active sector of the generation starting at given sector,
+ * returns secfalse if none of its sectors starts with a magic
+ */
+static secbool find_active_sector(norcow_generation_t *g, uint8_t first)
+{
+    g->compacting = secfalse;
+    for (uint8_t i = first; i < first + 2; i++) {
         const uint32_t *magic = norcow_ptr(i, 0, NORCOW_MAGIC_LEN);
-        if (magic != NULL && *magic == NORCOW_MAGIC) {
-            found = sectrue;
-            norcow_active_sector = i;
-            break;
+        if (magic != NULL && (*magic == NORCOW_MAGIC || *magic == NORCOW_TAIL_MAGIC)) {
+            g->active_sector = i;
+            norcow_tail[i] = sectrue * (*magic == NORCOW_TAIL_MAGIC);
+            return sectrue;
         }
     }
-    // no active sectors found - let's erase
-    if (sectrue == found) {
-        norcow_active_offset = find_free_offset(norcow_active_sector);
-    } else {
+    return secfalse;
+}
+
+/*
+ * Copies the latest item of a key into the generation it moved to, returns
+ * secfalse if the item does not fit even after a compaction
+ *
+ * The item is committed after its value is programmed, so that a move torn
+ * by a reset is not read and the next init moves the key again. Unlike
+ * set_item(), a value held by the generation already is never programmed
+ * over, as that would change a committed item.
+ */
+static secbool move_item(norcow_generation_t *g, uint16_t key, const void *val, uint16_t len)
+{
+    const void *old;
+    uint16_t old_len;
+    if (sectrue == lookup_item(g, key, &old, &old_len) && old_len == len && memcmp(old, val, len) == 0) {
+        return sectrue;
+    }
+    if (g->active_offset + item_size(g->active_sector, len) > sector_size(g->active_sector)) {
+        compact(g);
+        if (g->active_offset + item_size(g->active_sector, len) > sector_size(g->active_sector)) {
+            return secfalse;
+        }
+    }
+    ensure(flash_unlock(), NULL);
+    if (len > 0) {
+        ensure(flash_write_block(norcow_sectors[g->active_sector], g->active_offset + sizeof(uint32_t), val, len), NULL);
+    }
+    commit_item(g->active_sector, g->active_offset, key, len);
+    mirror_item(g, key, val, len);
+    index_item(g, g->active_sector, key, g->active_offset);
+    g->active_offset += item_size(g->active_sector, len);
+    ensure(flash_lock(), NULL);
+    return sectrue;
+}
+
+/*
+ * Copies the latest items of the keys found in the generation which belong
+ * to the other one, as left behind when the hot keys changed, returns
+ * whether there were any
+ *
+ * The hot generation is scanned, while the hot keys are looked up in the
+ * much larger cold generation. A hot key is copied only if the hot
+ * generation does not hold it yet, as otherwise it holds its latest value.
+ * A key which does not fit into its new generation stays in the old one,
+ * so the hot keys may end up differing from the selected ones.
+ */
+static secbool move_keys(norcow_generation_t *from)
+{
+    secbool moved = secfalse;
+    if (from == &norcow_generations[NORCOW_HOT]) {
+        for (uint32_t offset = NORCOW_MAGIC_LEN; offset < from->active_offset;) {
+            uint16_t k, l;
+            const void *v;
+            uint32_t pos;
+            if (sectrue != read_item(from->active_sector, offset, &k, &v, &l, &pos)) {
+                break;
+            }
+            const void *latest;
+            uint16_t latest_len;
+            if (k != NORCOW_SUMMARY_KEY && key_generation(k) != from &&
+                sectrue == lookup_item(from, k, &latest, &latest_len) && latest == v) {
+                if (sectrue == move_item(key_generation(k), k, v, l)) {
+                    moved = sectrue;
+                } else {
+                    norcow_hot[k / 32] |= 1U << (k % 32);
+                    norcow_hot_enabled = sectrue;
+                }
+            }
+            offset = pos;
+        }
+        return moved;
+    }
+    norcow_generation_t *hot = &norcow_generations[NORCOW_HOT];
+    for (uint32_t i = 0; i < 0x10000 / 32; i++) {
+        // visit the set bits only, lowest first
+        for (uint32_t bits = norcow_hot[i]; bits != 0; bits &= bits - 1) {
+            const uint16_t k = i * 32 + __builtin_ctz(bits);
+            const void *v;
+            uint16_t l;
+            if (sectrue != holds_key(hot, k) && sectrue == lookup_item(from, k, &v, &l)) {
+                if (sectrue == move_item(hot, k, v, l)) {
+                    moved = sectrue;
+                } else {
+                    norcow_hot[i] &= ~(1U << (k % 32));
+                }
+            }
+        }
+    }
+    return moved;
+}
+
+/*
+ * Initializes storage
+ */
+void norcow_init(void)
+{
+    flash_init();
+    norcow_streaming = secfalse;
+    norcow_generation_t *cold = &norcow_generations[NORCOW_COLD];
+    norcow_generation_t *hot = &norcow_generations[NORCOW_HOT];
+    // detect active sectors - starts with magic
+    if (sectrue != find_active_sector(cold, 0)) {
+        // no active sectors found - let's erase
         norcow_wipe();
+        return;
+    }
+    secbool found_hot = find_active_sector(hot, 2);
+    if (sectrue != found_hot && sectrue == norcow_hot_enabled) {
+        // the hot keys are still in the cold generation
+        wipe_generation(hot, 2);
+        found_hot = sectrue;
+    }
+    cold->active_offset = load_index(cold, cold->active_sector);
+    if (sectrue == found_hot) {
+        hot->active_offset = load_index(hot, hot->active_sector);
+    }
+
+    // an item torn by a reset before its commit word, or before the
+    // prefix of a streamed item, leaves programmed words behind the
+    // valid items, move them away from it
+    if (sectrue != is_erased(cold->active_sector, cold->active_offset)) {
+        compact(cold);
+    }
+    if (sectrue != found_hot) {
+        return;
+    }
+    // move the keys which changed their generation, the hot generation
+    // drops them right away so that it never holds outdated values
+    const secbool moved = move_keys(hot);
+    if (sectrue != norcow_hot_enabled) {
+        norcow_erase(2, secfalse);
+        norcow_erase(3, secfalse);
+        clear_index(hot);
+        return;
+    }
+    if (sectrue == moved || sectrue != is_erased(hot->active_sector, hot->active_offset)) {
+        compact(hot);
     }
+    move_keys(cold);
 }
 
 /*
@@ -248,12 +1052,20 @@ void norcow_init(void)
  */
 void norcow_wipe(void)
 {
-    norcow_erase(0, sectrue);
-    for (uint8_t i = 1; i < NORCOW_SECTOR_COUNT; i++) {
-        norcow_erase(i, secfalse);
+    wipe_generation(&norcow_generations[NORCOW_COLD], 0);
+    if (sectrue == norcow_hot_enabled) {
+        wipe_generation(&norcow_generations[NORCOW_HOT], 2);
+    } else {
+        // erase the unused hot generation only if it was written
+        norcow_generation_t *hot = &norcow_generations[NORCOW_HOT];
+        if (sectrue == find_active_sector(hot, 2)) {
+            norcow_erase(2, secfalse);
+            norcow_erase(3, secfalse);
+        }
+        clear_index(hot);
+        hot->compacting = secfalse;
     }
-    norcow_active_sector = 0;
-    norcow_active_offset = NORCOW_MAGIC_LEN;
+    norcow_streaming = secfalse;
 }
 
 /*
@@ -261,45 +1073,432 @@ void norcow_wipe(void)
  */
 secbool norcow_get(uint16_t key, const void **val, uint16_t *len)
 {
-    return find_item(norcow_active_sector, key, val, len);
+    return lookup_item(key_generation(key), key, val, len);
 }
 
 /*
- * Sets the given key, returns status of the operation
+ * Looks for count keys at once, returns sectrue if all of them were found
+ *
+ * The keys are resolved using the RAM indexes. If an index does not match
+ * the flash contents for any of them, all keys are resolved during one
+ * forward scan of the active sector of every generation.
  */
-secbool norcow_set(uint16_t key, const void *val, uint16_t len)
+secbool norcow_get_many(const uint16_t *keys, size_t count, const void **vals, uint16_t *lens)
 {
+    secbool found = sectrue, stale = secfalse;
+    for (size_t i = 0; i < count; i++) {
+        vals[i] = NULL;
+        lens[i] = 0;
+        const norcow_generation_t *g = key_generation(keys[i]);
+        const uint32_t offset = index_get(g, keys[i]);
+        if (offset == 0) {
+            if (sectrue == g->index_full) {
+                stale = sectrue;
+            } else {
+                found = secfalse;
+            }
+            continue;
+        }
+        uint16_t k;
+        uint32_t pos;
+        if (sectrue != read_item(g->active_sector, offset, &k, &vals[i], &lens[i], &pos) || k != keys[i]) {
+            vals[i] = NULL;
+            lens[i] = 0;
+            stale = sectrue;
+        }
+    }
+    if (sectrue != stale) {
+        return found;
+    }
+
+    for (uint8_t n = 0; n < generation_count(); n++) {
+        const norcow_generation_t *g = &norcow_generations[n];
+        uint32_t offset = NORCOW_MAGIC_LEN;
+        for (;;) {
+            uint16_t k, l;
+            const void *v;
+            uint32_t pos;
+            if (sectrue != read_item(g->active_sector, offset, &k, &v, &l, &pos)) {
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (keys[i] == k && (index_get(g, k) != 0 || sectrue == g->index_full) && key_generation(k) == g) {
+                    vals[i] = v;
+                    lens[i] = l;
+                }
+            }
+            offset = pos;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (vals[i] == NULL) {
+            found = secfalse;
+        }
+    }
+    return found;
+}
+
+/*
+ * Returns whether the value can be programmed over the old one by a single
+ * word write, which is the case if it only clears bits of one word, and
+ * stores the offset of that word
+ */
+static secbool is_updatable(const uint8_t *old, const uint8_t *val, uint16_t len, uint16_t *word)
+{
+    secbool found = secfalse;
+    for (uint16_t i = 0; i < len; i += sizeof(uint32_t)) {
+        const uint32_t rest = (uint32_t)len - i;
+        const uint16_t n = rest < sizeof(uint32_t) ? rest : sizeof(uint32_t);
+        if (memcmp(old + i, val + i, n) == 0) {
+            continue;
+        }
+        if (sectrue == found) {
+            return secfalse;
+        }
+        for (uint16_t j = i; j < i + n; j++) {
+            if ((old[j] & val[j]) != val[j]) {
+                return secfalse;
+            }
+        }
+        *word = i;
+        found = sectrue;
+    }
+    return found;
+}
+
+/*
+ * Programs the word of the value at given offset over the old value at ptr
+ * in given sector, the flash must be unlocked
+ */
+static void program_change(uint8_t sector, const uint8_t *ptr, const uint8_t *val, uint16_t len, uint16_t word)
+{
+    const uint32_t offset = ptr - (const uint8_t *)norcow_ptr(sector, 0, 0);
+    // the unaligned tail of the value keeps the zero padding behind it
+    uint32_t w;
+    memcpy(&w, ptr + word, sizeof(w));
+    const uint32_t rest = (uint32_t)len - word;
+    memcpy(&w, val + word, rest < sizeof(w) ? rest : sizeof(w));
+    ensure(flash_write_word(norcow_sectors[sector], offset + word, w), NULL);
+}
+
+/*
+ * Sets the given key in the generation, returns status of the operation
+ *
+ * A value equal to the current one is not written at all and a value
+ * which only clears bits of one word of the current one is programmed over
+ * it. A single word write leaves either value after a reset, while longer
+ * changes would leave a mix of both even in a tail sector, whose commit
+ * word is already written, so they are appended as usual.
+ */
+static secbool set_item(norcow_generation_t *g, uint16_t key, const void *val, uint16_t len)
+{
+    const void *old;
+    uint16_t old_len;
+    if (sectrue == lookup_item(g, key, &old, &old_len) && old_len == len) {
+        if (memcmp(old, val, len) == 0) {
+            return sectrue;
+        }
+        uint16_t word;
+        if (sectrue == is_updatable(old, val, len, &word)) {
+            ensure(flash_unlock(), NULL);
+            // update the copy of the item made by the running compaction too
+            if (sectrue == compact_copied(g, key)) {
+                const void *copy;
+                uint16_t copy_len;
+                ensure(find_item(next_sector(g), g->compact_first, g->compact_offsetw, key, &copy, &copy_len), "compaction copy missing");
+                program_change(next_sector(g), copy, val, len, word);
+            }
+            program_change(g->active_sector, old, val, len, word);
+            ensure(flash_lock(), NULL);
+            return sectrue;
+        }
+    }
+
     // check whether there is enough free space
     // and compact if full
-    if (norcow_active_offset + sizeof(uint32_t) + len > NORCOW_SECTOR_SIZE) {
-        compact();
+    if (g->active_offset + item_size(g->active_sector, len) > sector_size(g->active_sector)) {
+        compact(g);
     }
     // write item
     uint32_t pos;
-    secbool r = write_item(norcow_active_sector, norcow_active_offset, key, val, len, &pos);
+    ensure(flash_unlock(), NULL);
+    secbool r = program_item(g->active_sector, g->active_offset, key, val, len, &pos);
     if (sectrue == r) {
-        norcow_active_offset = pos;
+        mirror_item(g, key, val, len);
+        index_item(g, g->active_sector, key, g->active_offset);
+        g->active_offset = pos;
     }
+    ensure(flash_lock(), NULL);
     return r;
 }
 
+/*
+ * Sets the given key, returns status of the operation
+ */
+secbool norcow_set(uint16_t key, const void *val, uint16_t len)
+{
+    // the reserved item of an open write has to be committed first
+    if (sectrue == norcow_streaming) {
+        return secfalse;
+    }
+    return set_item(key_generation(key), key, val, len);
+}
+
+/*
+ * Returns the number of bytes the items of a batch which belong to the
+ * generation take in its active sector, capped just above the sector size
+ */
+static uint32_t batch_size(const norcow_generation_t *g, const uint16_t *keys, const uint16_t *lens, size_t count)
+{
+    const uint32_t size_max = sector_size(g->active_sector);
+    uint32_t size = 0;
+    for (size_t i = 0; i < count && size <= size_max; i++) {
+        if (key_generation(keys[i]) == g) {
+            size += item_size(g->active_sector, lens[i]);
+        }
+    }
+    return size;
+}
+
+/*
+ * Sets the given keys in one run, returns status of the operation
+ *
+ * The free space is checked once for the whole batch and every generation
+ * is compacted at most once. Nothing is written if the batch does not fit
+ * even after the compaction.
+ */
+secbool norcow_set_many(const uint16_t *keys, const void *const *vals, const uint16_t *lens, size_t count)
+{
+    // the reserved item of an open write has to be committed first
+    if (sectrue == norcow_streaming) {
+        return secfalse;
+    }
+    for (uint8_t n = 0; n < generation_count(); n++) {
+        norcow_generation_t *g = &norcow_generations[n];
+        const uint32_t size_max = sector_size(g->active_sector);
+        uint32_t size = batch_size(g, keys, lens, count);
+        if (size > size_max - NORCOW_MAGIC_LEN) {
+            return secfalse;
+        }
+        // check whether there is enough free space
+        // and compact if full
+        if (g->active_offset + size > size_max) {
+            compact(g);
+            // the compaction may have changed the record format
+            size = batch_size(g, keys, lens, count);
+            if (g->active_offset + size > size_max) {
+                return secfalse;
+            }
+        }
+    }
+    // write items
+    secbool r = sectrue;
+    ensure(flash_unlock(), NULL);
+    for (size_t i = 0; i < count; i++) {
+        norcow_generation_t *g = key_generation(keys[i]);
+        uint32_t pos;
+        r = program_item(g->active_sector, g->active_offset, keys[i], vals[i], lens[i], &pos);
+        if (sectrue != r) {
+            break;
+        }
+        mirror_item(g, keys[i], vals[i], lens[i]);
+        index_item(g, g->active_sector, keys[i], g->active_offset);
+        g->active_offset = pos;
+    }
+    ensure(flash_lock(), NULL);
+    return r;
+}
+
+/*
+ * Opens a write of a value of given length, returns status of the operation
+ *
+ * The item is reserved at the end of the active sector of its generation,
+ * which gets compacted first if it does not fit. The value is programmed
+ * chunk by chunk by norcow_set_append() and published by
+ * norcow_set_commit().
+ */
+secbool norcow_set_begin(uint16_t key, uint16_t len)
+{
+    if (sectrue == norcow_streaming) {
+        return secfalse;
+    }
+    norcow_generation_t *g = key_generation(key);
+    // check whether there is enough free space
+    // and compact if full
+    if (g->active_offset + item_size(g->active_sector, len) > sector_size(g->active_sector)) {
+        compact(g);
+        if (g->active_offset + item_size(g->active_sector, len) > sector_size(g->active_sector)) {
+            return secfalse;
+        }
+    }
+    norcow_stream_key = key;
+    norcow_stream_len = len;
+    norcow_stream_pos = 0;
+    norcow_streaming = sectrue;
+    return sectrue;
+}
+
+/*
+ * Programs the next chunk of the value of the open write
+ */
+secbool norcow_set_append(const void *data, uint16_t len)
+{
+    if (sectrue != norcow_streaming || len > norcow_stream_len - norcow_stream_pos) {
+        return secfalse;
+    }
+    const norcow_generation_t *g = key_generation(norcow_stream_key);
+    const uint32_t offset = g->active_offset + sizeof(uint32_t) + norcow_stream_pos;
+    ensure(flash_unlock(), NULL);
+    ensure(flash_write_block(norcow_sectors[g->active_sector], offset, data, len), NULL);
+    ensure(flash_lock(), NULL);
+    norcow_stream_pos += len;
+    return sectrue;
+}
+
+/*
+ * Commits the open write by programming the padding, the prefix and in a
+ * tail sector the trailing commit word of its item
+ *
+ * A write whose value was not completely appended is dropped by
+ * norcow_set_abort().
+ */
+secbool norcow_set_commit(void)
+{
+    if (sectrue != norcow_streaming) {
+        return secfalse;
+    }
+    const uint16_t key = norcow_stream_key, len = norcow_stream_len;
+    norcow_generation_t *g = key_generation(key);
+    if (norcow_stream_pos != len) {
+        norcow_set_abort();
+        return secfalse;
+    }
+    norcow_streaming = secfalse;
+
+    const uint8_t sector = g->active_sector;
+    const uint32_t pos = g->active_offset + item_size(sector, len);
+    ensure(flash_unlock(), NULL);
+    commit_item(sector, g->active_offset, key, len);
+    mirror_item(g, key, norcow_ptr(sector, g->active_offset + sizeof(uint32_t), len), len);
+    index_item(g, sector, key, g->active_offset);
+    g->active_offset = pos;
+    ensure(flash_lock(), NULL);
+    return sectrue;
+}
+
+/*
+ * Drops the open write, if there is one
+ *
+ * If any of its chunks got programmed, the reserved space is reclaimed by
+ * compacting the active sector, as the next item would be programmed over
+ * them.
+ */
+void norcow_set_abort(void)
+{
+    if (sectrue != norcow_streaming) {
+        return;
+    }
+    norcow_streaming = secfalse;
+    if (norcow_stream_pos > 0) {
+        compact(key_generation(norcow_stream_key));
+    }
+}
+
 /*
  * Update a word in flash at the given pointer.  The pointer must point
  * into the NORCOW area.
  */
 secbool norcow_update(uint16_t key, uint16_t offset, uint32_t value)
 {
+    const norcow_generation_t *g = key_generation(key);
     const void *ptr;
     uint16_t len;
-    if (sectrue != find_item(norcow_active_sector, key, &ptr, &len)) {
+    if (sectrue != lookup_item(g, key, &ptr, &len)) {
         return secfalse;
     }
     if ((offset & 3) != 0 || offset >= len) {
         return secfalse;
     }
-    uint32_t sector_offset = (const uint8_t*) ptr - (const uint8_t *)norcow_ptr(norcow_active_sector, 0, NORCOW_SECTOR_SIZE) + offset;
+    uint32_t sector_offset = (const uint8_t*) ptr - (const uint8_t *)norcow_ptr(g->active_sector, 0, 0) + offset;
     ensure(flash_unlock(), NULL);
-    ensure(flash_write_word(norcow_sectors[norcow_active_sector], sector_offset, value), NULL);
+    ensure(flash_write_word(norcow_sectors[g->active_sector], sector_offset, value), NULL);
     ensure(flash_lock(), NULL);
+
+    // update the copy of the item made by the running compaction too
+    if (sectrue == compact_copied(g, key)) {
+        const uint8_t norcow_next_sector = next_sector(g);
+        ensure(find_item(norcow_next_sector, g->compact_first, g->compact_offsetw, key, &ptr, &len), "compaction copy missing");
+        sector_offset = (const uint8_t*) ptr - (const uint8_t *)norcow_ptr(norcow_next_sector, 0, 0) + offset;
+        ensure(flash_unlock(), NULL);
+        ensure(flash_write_word(norcow_sectors[norcow_next_sector], sector_offset, value), NULL);
+        ensure(flash_lock(), NULL);
+    }
     return sectrue;
 }
+
+/*
+ * Runs the incremental compaction, copying at most budget items per call
+ *
+ * A call works on the running compaction, or starts one of the first
+ * generation whose compaction is due.
+ */
+secbool norcow_maintenance(uint32_t budget)
+{
+    secbool idle = sectrue;
+    norcow_generation_t *due = NULL;
+    for (uint8_t n = 0; n < generation_count(); n++) {
+        norcow_generation_t *g = &norcow_generations[n];
+        const uint32_t threshold = NORCOW_COMPACT_THRESHOLD(sector_size(g->active_sector));
+        if (sectrue == g->compacting) {
+            // only one compaction runs at a time
+            idle = secfalse;
+            due = g;
+            break;
+        }
+        // start only if the compaction gets the sector below the threshold
+        if (due == NULL && g->active_offset >= threshold && g->active_offset - g->garbage < threshold) {
+            due = g;
+        }
+    }
+    // the compaction must not switch sectors under an open write
+    if (due == NULL || sectrue == norcow_streaming) {
+        return idle;
+    }
+    if (sectrue != due->compacting) {
+        compact_start(due);
+    }
+    return compact_step(due, budget);
+}
+
+/*
+ * Selects the record format of the sectors written from now on
+ */
+void norcow_set_tail_records(secbool enable)
+{
+    norcow_tail_records = enable;
+}
+
+/*
+ * Selects whether compactions write an index summary
+ */
+void norcow_set_index_summary(secbool enable)
+{
+    norcow_summary = enable;
+}
+
+/*
+ * Selects the keys of the hot generation
+ */
+void norcow_set_hot_keys(const uint16_t *keys, size_t count)
+{
+    memset(norcow_hot, 0, sizeof(norcow_hot));
+    norcow_hot_enabled = secfalse;
+    for (size_t i = 0; i < count; i++) {
+        // every generation keeps its own index summary
+        if (keys[i] == NORCOW_SUMMARY_KEY) {
+            continue;
+        }
+        norcow_hot[keys[i] / 32] |= 1U << (keys[i] % 32);
+        norcow_hot_enabled = sectrue;
+    }
+}
@@ -20,6 +20,7 @@
 #ifndef __NORCOW_H__
 #define __NORCOW_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include "secbool.h"
 
@@ -44,15 +45,73 @@ void norcow_wipe(void);
  */
 secbool norcow_get(uint16_t key, const void **val, uint16_t *len);
 
+/*
+ * Looks for count keys at once, missing keys get a NULL value.
+ * Returns sectrue if all keys were found.
+ */
+secbool norcow_get_many(const uint16_t *keys, size_t count, const void **vals, uint16_t *lens);
+
 /*
  * Sets the given key, returns status of the operation
+ * Values equal to the current one are skipped and values which only
+ * clear bits of a single word of it are programmed in place. That word is
+ * programmed at once, so a reset leaves either the old or the new value,
+ * as it does for appended values in a tail sector.
  */
 secbool norcow_set(uint16_t key, const void *val, uint16_t len);
 
+/*
+ * Sets count keys in one run, the later of two equal keys wins.
+ * Returns secfalse without writing anything if the batch does not fit.
+ */
+secbool norcow_set_many(const uint16_t *keys, const void *const *vals, const uint16_t *lens, size_t count);
+
+/*
+ * Writes a value of len bytes in chunks: norcow_set_begin() reserves its
+ * item, norcow_set_append() programs the chunks and norcow_set_commit()
+ * publishes the value, which is not visible before, not even after a reset.
+ * Other writes fail until the commit or until norcow_set_abort() drops
+ * the write. A commit of an incomplete value drops it and returns secfalse.
+ */
+secbool norcow_set_begin(uint16_t key, uint16_t len);
+secbool norcow_set_append(const void *data, uint16_t len);
+secbool norcow_set_commit(void);
+void norcow_set_abort(void);
+
 /*
  * Update a word in flash in the given key at the given offset.
  * Note that you can only change bits from 1 to 0.
  */
 secbool norcow_update(uint16_t key, uint16_t offset, uint32_t value);
 
+/*
+ * Runs at most budget steps of an incremental compaction, to be called
+ * when idle. A compaction is started once the active sector of a generation
+ * is filled beyond NORCOW_COMPACT_THRESHOLD. Returns sectrue if no
+ * compaction is left running.
+ */
+secbool norcow_maintenance(uint32_t budget);
+
+/*
+ * Selects whether the sectors written by the following wipes and
+ * compactions end every item with a commit word, which allows scanning
+ * them backwards. Sectors of both formats are read.
+ */
+void norcow_set_tail_records(secbool enable);
+
+/*
+ * Selects whether the following compactions start the sector with a
+ * summary of the RAM index, from which norcow_init() loads the index
+ * instead of scanning all items.
+ */
+void norcow_set_index_summary(secbool enable);
+
+/*
+ * Selects the keys kept in the hot generation, a sector pair of its own
+ * which is compacted without copying the other keys. To be called before
+ * norcow_init() or norcow_wipe(), the init moves the keys whose generation
+ * changed. No keys leave the hot generation unused.
+ */
+void norcow_set_hot_keys(const uint16_t *keys, size_t count);
+
 #endif
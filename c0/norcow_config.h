@@ -22,8 +22,26 @@
 
 #include "flash.h"
 
-#define NORCOW_SECTOR_COUNT 2
+// every generation is a pair of sectors: the cold generation holds most
+// keys, the hot one the keys selected by norcow_set_hot_keys() and is
+// used only if there are any
+#define NORCOW_GENERATION_COUNT 2
+#define NORCOW_SECTOR_COUNT (2 * NORCOW_GENERATION_COUNT)
 #define NORCOW_SECTOR_SIZE  (64*1024)
-#define NORCOW_SECTORS      {4, 16}
+#define NORCOW_SECTORS      {4, 16, 3, 15}
+#define NORCOW_GENERATION_SIZES {NORCOW_SECTOR_SIZE, 16*1024}
+
+// norcow_maintenance() compacts once the active sector of a generation of
+// given size is filled beyond this offset, so that sets rarely find it full
+#define NORCOW_COMPACT_THRESHOLD(SIZE) ((SIZE) / 4 * 3)
+
+// entries of the RAM index of every generation, four bytes each, which
+// index up to three quarters as many keys; further keys are found by
+// scanning the active sector and compacted in further passes
+#define NORCOW_INDEX_SIZE 1024
+
+// key of the index summary written by the compaction, APP 0 is reserved
+// for the storage itself
+#define NORCOW_SUMMARY_KEY 0x00FF
 
 #endif
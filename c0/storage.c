@@ -183,6 +183,9 @@ secbool storage_check_pin(const uint32_t pin)
 secbool storage_unlock(const uint32_t pin)
 {
     unlocked = secfalse;
+    // a write left open by the previous session would block the PIN fail
+    // counter
+    norcow_set_abort();
     if (sectrue == initialized && sectrue == storage_check_pin(pin)) {
         unlocked = sectrue;
     }
@@ -203,6 +206,24 @@ secbool storage_get(const uint16_t key, const void **val, uint16_t *len)
     return norcow_get(key, val, len);
 }
 
+secbool storage_get_many(const uint16_t *keys, size_t count, const void **vals, uint16_t *lens)
+{
+    if (sectrue != initialized) {
+        return secfalse;
+    }
+    secbool r = norcow_get_many(keys, count, vals, lens);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t app = keys[i] >> 8;
+        // the same rules as in storage_get
+        if (app == 0 || (sectrue != unlocked && ((app & 0x80) == 0))) {
+            vals[i] = NULL;
+            lens[i] = 0;
+            r = secfalse;
+        }
+    }
+    return r;
+}
+
 secbool storage_set(const uint16_t key, const void *val, uint16_t len)
 {
     const uint8_t app = key >> 8;
@@ -213,6 +234,62 @@ secbool storage_set(const uint16_t key, const void *val, uint16_t len)
     return norcow_set(key, val, len);
 }
 
+secbool storage_set_many(const uint16_t *keys, const void *const *vals, const uint16_t *lens, size_t count)
+{
+    if (sectrue != initialized || sectrue != unlocked) {
+        return secfalse;
+    }
+    // APP == 0 is reserved for PIN related values
+    for (size_t i = 0; i < count; i++) {
+        if ((keys[i] >> 8) == 0) {
+            return secfalse;
+        }
+    }
+    return norcow_set_many(keys, vals, lens, count);
+}
+
+secbool storage_set_begin(const uint16_t key, uint16_t len)
+{
+    const uint8_t app = key >> 8;
+    // APP == 0 is reserved for PIN related values
+    if (sectrue != initialized || sectrue != unlocked || app == 0) {
+        return secfalse;
+    }
+    return norcow_set_begin(key, len);
+}
+
+secbool storage_set_append(const void *data, uint16_t len)
+{
+    if (sectrue != initialized || sectrue != unlocked) {
+        return secfalse;
+    }
+    return norcow_set_append(data, len);
+}
+
+secbool storage_set_commit(void)
+{
+    if (sectrue != initialized || sectrue != unlocked) {
+        return secfalse;
+    }
+    return norcow_set_commit();
+}
+
+void storage_set_abort(void)
+{
+    if (sectrue != initialized) {
+        return;
+    }
+    norcow_set_abort();
+}
+
+secbool storage_maintenance(uint32_t budget)
+{
+    if (sectrue != initialized) {
+        return secfalse;
+    }
+    return norcow_maintenance(budget);
+}
+
 secbool storage_has_pin(void)
 {
     if (sectrue != initialized) {
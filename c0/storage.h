@@ -33,6 +33,13 @@ secbool storage_unlock(const uint32_t pin);
 secbool storage_has_pin(void);
 secbool storage_change_pin(const uint32_t oldpin, const uint32_t newpin);
 secbool storage_get(const uint16_t key, const void **val, uint16_t *len);
+secbool storage_get_many(const uint16_t *keys, size_t count, const void **vals, uint16_t *lens);
 secbool storage_set(const uint16_t key, const void *val, uint16_t len);
+secbool storage_set_many(const uint16_t *keys, const void *const *vals, const uint16_t *lens, size_t count);
+secbool storage_set_begin(const uint16_t key, uint16_t len);
+secbool storage_set_append(const void *data, uint16_t len);
+secbool storage_set_commit(void);
+void storage_set_abort(void);
+secbool storage_maintenance(uint32_t budget);
 
 #endif
@@ -1,49 +1,227 @@
 import ctypes as c
+import mmap
 import os
+import shutil
+import struct
+import tempfile
+import threading
+import weakref
 
 sectrue = -1431655766  # 0xAAAAAAAAA
 fname = os.path.join(os.path.dirname(__file__), "libtrezor-storage0.so")
 
+# The dynamic loader returns the same handle for every load of one file, so
+# all instances would share the flash and the storage state. Every instance
+# therefore gets its own copy of the library, which is returned to a pool
+# once the instance is garbage collected.
+_libs = []
+_libs_lock = threading.Lock()
+
+
+def _acquire_lib() -> c.CDLL:
+    with _libs_lock:
+        if _libs:
+            return _libs.pop()
+    with tempfile.NamedTemporaryFile(dir=os.path.dirname(fname), suffix=".so") as tmp:
+        with open(fname, "rb") as lib:
+            shutil.copyfileobj(lib, tmp)
+        tmp.flush()
+        return c.CDLL(tmp.name)
+
+
+def _release_lib(lib: c.CDLL) -> None:
+    with _libs_lock:
+        _libs.append(lib)
+
+
+FLASH_SECTOR_COUNT = 24
+FLASH_POWER_ON = 2**64 - 1
+# flash offsets and sizes of NORCOW_SECTORS in norcow_config.h, the sectors
+# 4 and 16 of the cold generation and 3 and 15 of the hot one
+NORCOW_SECTORS = ((0x010000, 0x10000), (0x110000, 0x10000), (0x00C000, 0x4000), (0x10C000, 0x4000))
+
+
+class FlashStats(c.Structure):
+    # mirrors flash_stats_t in flash.h
+    _fields_ = [
+        ("erase_count", c.c_uint32 * FLASH_SECTOR_COUNT),
+        ("byte_writes", c.c_uint64),
+        ("word_writes", c.c_uint64),
+        ("rejected_writes", c.c_uint64),
+        ("programmed_bytes", c.c_uint64),
+        ("read_bytes", c.c_uint64),
+    ]
+
+
+class FlashTiming(c.Structure):
+    # mirrors flash_timing_t in flash.h, all values in microseconds
+    _fields_ = [
+        ("byte_program_us", c.c_uint32),
+        ("word_program_us", c.c_uint32),
+        ("erase_16k_us", c.c_uint32),
+        ("erase_64k_us", c.c_uint32),
+        ("erase_128k_us", c.c_uint32),
+    ]
+
+
+# Storage call trace replayed by replay.c.
+CALL_TRACE_MAGIC = b"STRC"
+CALL_TRACE_VERSION = 1
+CALL_INIT = 1
+CALL_WIPE = 2
+CALL_UNLOCK = 3
+CALL_LOCK = 4
+CALL_CHANGE_PIN = 5
+CALL_GET = 6
+CALL_SET = 7
+CALL_DELETE = 8
+CALL_SET_COUNTER = 9
+CALL_NEXT_COUNTER = 10
+CALL_CHECK_PIN = 11
+
+
+def _map_flash_image(path: str, size: int, persistent: bool) -> mmap.mmap:
+    # MAP_SHARED writes the flash contents through to the image file,
+    # MAP_PRIVATE keeps the changes in the process only
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        if os.fstat(fd).st_size == 0:
+            os.ftruncate(fd, size)
+        if os.fstat(fd).st_size != size:
+            raise RuntimeError("Failed to map flash image due to length mismatch.")
+        flags = mmap.MAP_SHARED if persistent else mmap.MAP_PRIVATE
+        return mmap.mmap(fd, size, flags=flags)
+    finally:
+        os.close(fd)
+
+
 class Storage:
 
-    def __init__(self) -> None:
-        self.lib = c.cdll.LoadLibrary(fname)
+    def __init__(
+        self,
+        flash_image: str = None,
+        persistent: bool = False,
+        tail_records: bool = False,
+        index_summary: bool = False,
+        hot_keys=(),
+    ) -> None:
+        self.lib = _acquire_lib()
+        weakref.finalize(self, _release_lib, self.lib)
+        # pooled libraries keep the emulator state and the options of their
+        # previous instance
+        self.lib.flash_reset()
+        self.lib.norcow_set_tail_records(sectrue if tail_records else 0)
+        self.lib.norcow_set_index_summary(sectrue if index_summary else 0)
+        hot_keys = list(hot_keys)
+        self.lib.norcow_set_hot_keys((c.c_uint16 * len(hot_keys))(*hot_keys), c.c_size_t(len(hot_keys)))
         self.flash_size = c.cast(self.lib.FLASH_SIZE, c.POINTER(c.c_uint32))[0]
-        self.flash_buffer = c.create_string_buffer(self.flash_size)
+        if flash_image is None:
+            self.flash_buffer = c.create_string_buffer(self.flash_size)
+        else:
+            self.flash_map = _map_flash_image(flash_image, self.flash_size, persistent)
+            self.flash_buffer = (c.c_char * self.flash_size).from_buffer(self.flash_map)
         c.cast(self.lib.FLASH_BUFFER, c.POINTER(c.c_void_p))[0] = c.addressof(self.flash_buffer)
+        self.lib.flash_snapshot_dirty()
+        self.lib.flash_clock_us.restype = c.c_uint64
+        self.call_trace = None
+        self.stream = None
 
     def init(self) -> None:
+        self._record(CALL_INIT)
         self.lib.storage_init(0)
 
     def wipe(self) -> None:
+        self._record(CALL_WIPE)
         self.lib.storage_wipe()
 
     def check_pin(self, pin: int) -> bool:
+        self._record(CALL_CHECK_PIN, arg0=pin)
         return sectrue == self.lib.storage_check_pin(c.c_uint32(pin))
 
     def unlock(self, pin: int) -> bool:
+        self._record(CALL_UNLOCK, arg0=pin)
+        # the unlock drops an open write
+        self.stream = None
         return sectrue == self.lib.storage_unlock(c.c_uint32(pin))
 
     def has_pin(self) -> bool:
         return sectrue == self.lib.storage_has_pin()
 
     def change_pin(self, oldpin: int, newpin: int) -> bool:
+        self._record(CALL_CHANGE_PIN, arg0=oldpin, arg1=newpin)
         return sectrue == self.lib.storage_change_pin(c.c_uint32(oldpin), c.c_uint32(newpin))
 
     def get(self, key: int) -> bytes:
+        self._record(CALL_GET, key)
         val_ptr = c.c_void_p()
         val_len = c.c_uint16()
         if sectrue != self.lib.storage_get(c.c_uint16(key), c.byref(val_ptr), c.byref(val_len)):
             raise RuntimeError("Failed to find key in storage.")
         return c.string_at(val_ptr, size=val_len.value)
 
+    def get_many(self, keys) -> list:
+        # values of the keys in one call, None for missing keys
+        keys = list(keys)
+        for key in keys:
+            self._record(CALL_GET, key)
+        n = len(keys)
+        vals = (c.c_void_p * n)()
+        lens = (c.c_uint16 * n)()
+        self.lib.storage_get_many((c.c_uint16 * n)(*keys), c.c_size_t(n), vals, lens)
+        return [c.string_at(v, size=l) if v else None for v, l in zip(vals, lens)]
+
     def set(self, key: int, val: bytes) -> None:
+        self._record(CALL_SET, key, data=val)
         if sectrue != self.lib.storage_set(c.c_uint16(key), val, c.c_uint16(len(val))):
             raise RuntimeError("Failed to set value in storage.")
 
+    def set_many(self, items) -> None:
+        # items is a sequence of (key, val) pairs, which are passed in one call
+        keys = [key for key, _ in items]
+        vals = [val for _, val in items]
+        for key, val in items:
+            self._record(CALL_SET, key, data=val)
+        n = len(keys)
+        if sectrue != self.lib.storage_set_many(
+            (c.c_uint16 * n)(*keys),
+            (c.c_char_p * n)(*vals),
+            (c.c_uint16 * n)(*map(len, vals)),
+            c.c_size_t(n),
+        ):
+            raise RuntimeError("Failed to set values in storage.")
+
+    def set_begin(self, key: int, length: int) -> None:
+        # opens a write of a value of length bytes passed by set_append
+        if sectrue != self.lib.storage_set_begin(c.c_uint16(key), c.c_uint16(length)):
+            raise RuntimeError("Failed to begin value in storage.")
+        # the chunks are traced as one set at the commit
+        self.stream = (key, []) if self.call_trace else None
+
+    def set_append(self, data: bytes) -> None:
+        if sectrue != self.lib.storage_set_append(data, c.c_uint16(len(data))):
+            raise RuntimeError("Failed to append value in storage.")
+        if self.stream:
+            self.stream[1].append(data)
+
+    def set_commit(self) -> None:
+        if sectrue != self.lib.storage_set_commit():
+            raise RuntimeError("Failed to commit value in storage.")
+        if self.stream:
+            self._record(CALL_SET, self.stream[0], data=b"".join(self.stream[1]))
+            self.stream = None
+
+    def set_abort(self) -> None:
+        # drops the write opened by set_begin, if there is one
+        self.lib.storage_set_abort()
+        self.stream = None
+
+    def maintenance(self, budget: int) -> bool:
+        # True if no compaction is left running
+        return sectrue == self.lib.storage_maintenance(c.c_uint32(budget))
+
     def _dump(self) -> bytes:
-        # return just sectors 4 and 16 of the whole flash
-        return [self.flash_buffer[0x010000:0x010000 + 0x10000], self.flash_buffer[0x110000:0x110000 + 0x10000]]
+        # return the norcow sectors of the whole flash, the hot ones last
+        return [self.flash_buffer[offset:offset + size] for offset, size in NORCOW_SECTORS]
 
     def _get_flash_buffer(self) -> bytes:
         return bytes(self.flash_buffer)
@@ -51,4 +229,56 @@ class Storage:
     def _set_flash_buffer(self, buf: bytes) -> None:
         if len(buf) != self.flash_size:
             raise RuntimeError("Failed to set flash buffer due to length mismatch.")
-        self.flash_buffer = buf
+        c.memmove(self.flash_buffer, buf, self.flash_size)
+        self.lib.flash_snapshot_dirty()
+
+    def _snapshot(self) -> int:
+        sid = self.lib.flash_snapshot()
+        if sid < 0:
+            raise RuntimeError("Failed to take flash snapshot.")
+        return sid
+
+    def _restore(self, sid: int) -> None:
+        # the storage has to be initialized again after the flash is restored
+        if sectrue != self.lib.flash_restore(sid):
+            raise RuntimeError("Failed to restore flash snapshot.")
+
+    def _free_snapshot(self, sid: int) -> None:
+        self.lib.flash_snapshot_free(sid)
+
+    def _get_flash_stats(self) -> FlashStats:
+        stats = FlashStats()
+        self.lib.flash_stats_get(c.byref(stats))
+        return stats
+
+    def _reset_flash_stats(self) -> None:
+        self.lib.flash_stats_reset()
+
+    def _power_cut(self, ops: int = FLASH_POWER_ON) -> None:
+        # the flash ignores all erases and program operations after the next ops
+        self.lib.flash_power_cut(c.c_uint64(ops))
+
+    def _get_clock(self) -> int:
+        # virtual time in microseconds spent in flash operations and delays
+        return self.lib.flash_clock_us()
+
+    def _get_flash_timing(self) -> FlashTiming:
+        timing = FlashTiming()
+        self.lib.flash_timing_get(c.byref(timing))
+        return timing
+
+    def _set_flash_timing(self, timing: FlashTiming) -> None:
+        self.lib.flash_timing_set(c.byref(timing))
+
+    def _call_trace_start(self, path: str) -> None:
+        self.call_trace = open(path, "wb")
+        self.call_trace.write(CALL_TRACE_MAGIC + struct.pack("<I", CALL_TRACE_VERSION))
+
+    def _call_trace_stop(self) -> None:
+        if self.call_trace:
+            self.call_trace.close()
+            self.call_trace = None
+
+    def _record(self, op: int, key: int = 0, arg0: int = 0, arg1: int = 0, data: bytes = b"") -> None:
+        if self.call_trace:
+            self.call_trace.write(struct.pack("<BHIIH", op, key, arg0, arg1, len(data)) + data)
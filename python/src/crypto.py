@@ -1,3 +1,5 @@
+import functools
+
 from cryptography.hazmat.backends import default_backend
 from cryptography.hazmat.primitives import hashes, hmac
 from cryptography.hazmat.primitives.ciphers import Cipher, algorithms
@@ -7,7 +9,19 @@ from cryptography.hazmat.primitives.kdf.pbkdf2 import PBKDF2HMAC
 from . import consts, prng
 
 
-def derive_kek_keiv(salt: bytes, pin: int) -> (bytes, bytes):
+def enable_kdf_cache(enable: bool = True, size: int = 256):
+    """
+    Memoizes derive_kek_keiv() in an LRU cache. Only meant for the tests,
+    which unlock the storage with the same PIN and salt over and over.
+    """
+    global derive_kek_keiv
+    if enable:
+        derive_kek_keiv = functools.lru_cache(maxsize=size)(_derive_kek_keiv)
+    else:
+        derive_kek_keiv = _derive_kek_keiv
+
+
+def _derive_kek_keiv(salt: bytes, pin: int) -> (bytes, bytes):
     kdf = PBKDF2HMAC(
         algorithm=hashes.SHA256(),
         length=consts.KEK_SIZE + consts.KEIV_SIZE,
@@ -24,6 +38,9 @@ def derive_kek_keiv(salt: bytes, pin: int) -> (bytes, bytes):
     return kek, keiv
 
 
+derive_kek_keiv = _derive_kek_keiv
+
+
 def chacha_poly_encrypt(
     key: bytes, iv: bytes, data: bytes, additional_data: bytes = None
 ) -> (bytes, bytes):
@@ -94,6 +111,22 @@ def init_hmacs(sak: bytes) -> bytes:
     return _final_hmac(sak, b"\x00" * hashes.SHA256.digest_size)
 
 
+def empty_hmacs() -> bytes:
+    return b"\x00" * hashes.SHA256.digest_size
+
+
+def xor_hmac(sak: bytes, hmacs: bytes, key: bytes) -> bytes:
+    """
+    Adds or removes the HMAC of KEY to or from the XOR of the HMACs,
+    see calculate_hmacs.
+    """
+    return _xor(hmacs, _hmac(sak, key))
+
+
+def final_hmacs(sak: bytes, hmacs: bytes) -> bytes:
+    return _final_hmac(sak, hmacs)
+
+
 def _final_hmac(sak: bytes, data: bytes) -> bytes:
     return _hmac(sak, data)[: consts.SAT_SIZE]
 
@@ -12,32 +12,68 @@ def align4_data(data):
     return data + b"\x00" * align4_int(len(data))
 
 
+FLASH_SIZE = consts.NORCOW_SECTOR_SIZE * consts.NORCOW_SECTOR_COUNT
+ERASED_FLASH = b"\xff" * FLASH_SIZE
+
+# Page digests, these mirror the ones in c/flash.c.
+DIGEST_PAGE_SIZE = 256
+DIGEST_PAGE_COUNT = consts.NORCOW_SECTOR_SIZE // DIGEST_PAGE_SIZE
+DIGEST_PRIME = 0x9E3779B97F4A7BB9
+MASK64 = 0xFFFFFFFFFFFFFFFF
+
+
+def page_digest(page) -> int:
+    return int.from_bytes(page, "little") % DIGEST_PRIME
+
+
+def mix_page_digest(page: int, digest: int) -> int:
+    # splitmix64 finalizer
+    z = (digest + page * 0x9E3779B97F4A7C15) & MASK64
+    z = ((z ^ (z >> 30)) * 0xBF58476D1CE4E5B9) & MASK64
+    z = ((z ^ (z >> 27)) * 0x94D049BB133111EB) & MASK64
+    return z ^ (z >> 31)
+
+
 class Norcow:
     def __init__(self):
+        # All sectors live in one contiguous buffer, self.sectors holds
+        # memoryviews into it, so reading and dumping does not copy.
+        self.buffer = None
         self.sectors = None
+        # Digests of the pages of every sector and of the sectors, None if
+        # they have to be recomputed. dirty holds the pages of every
+        # sector written since the sector digest was queried.
+        self.page_digests = None
+        self.sector_digests = None
+        self.dirty = None
+        # Maps each key to the (offset, length) of its latest item
+        # in the active sector.
+        self.index = {}
 
     def init(self):
         if self.sectors:
             for sector in range(consts.NORCOW_SECTOR_COUNT):
                 if self.sectors[sector][:8] == consts.NORCOW_MAGIC_AND_VERSION:
                     self.active_sector = sector
-                    self.active_offset = len(consts.NORCOW_MAGIC_AND_VERSION)
+                    self.active_offset = self._build_index()
                     break
         else:
             self.wipe()
 
     def wipe(self, sector: int = 0):
-        self.sectors = [
-            bytearray([0xFF] * consts.NORCOW_SECTOR_SIZE)
-            for _ in range(consts.NORCOW_SECTOR_COUNT)
-        ]
+        self._allocate()
+        self.buffer[:] = ERASED_FLASH
+        self.page_digests = None
         self.sectors[sector][:8] = consts.NORCOW_MAGIC_AND_VERSION
         self.active_sector = sector
         self.active_offset = len(consts.NORCOW_MAGIC_AND_VERSION)
+        self.index = {}
 
     def get(self, key: int) -> bytes:
         value, _ = self._find_item(key)
-        return value
+        if value is False:
+            return value
+        return bytes(value)
 
     def set(self, key: int, val: bytes):
         if key == consts.NORCOW_KEY_FREE:
@@ -92,6 +128,9 @@ class Norcow:
         return True
 
     def _delete_old(self, pos: int, value: bytes):
+        key, _ = self._read_item(pos)
+        if self.index.get(key, (None,))[0] == pos:
+            del self.index[key]
         wiped_data = b"\x00" * len(value)
         self._write(pos, 0x0000, wiped_data)
 
@@ -103,60 +142,61 @@ class Norcow:
         if pos + len(data) > consts.NORCOW_SECTOR_SIZE:
             raise RuntimeError("Norcow: item too big")
         self.sectors[self.active_sector][pos : pos + len(data)] = data
+        self._mark_pages(self.active_sector, pos, len(data))
+        self._index_item(pos, key, len(new_value))
         return len(data)
 
-    def _find_item(self, key: int) -> (bytes, int):
+    def _index_item(self, pos: int, key: int, length: int):
+        # the latest item wins, so an item written behind the indexed one
+        # (e.g. a deleted item) does not replace it
+        if self.index.get(key, (-1,))[0] <= pos:
+            self.index[key] = (pos, length)
+
+    def _build_index(self) -> int:
+        """
+        Rebuilds the index from the active sector and returns the offset
+        of its free space.
+        """
+        self.index = {}
         offset = len(consts.NORCOW_MAGIC_AND_VERSION)
-        value = False
-        pos = offset
-        while True:
+        while offset + 4 <= consts.NORCOW_SECTOR_SIZE:
             try:
                 k, v = self._read_item(offset)
-                if k == key:
-                    value = v
-                    pos = offset
             except ValueError:
                 break
+            self.index[k] = (offset, len(v))
             offset = offset + self._norcow_item_length(v)
+        return offset
+
+    def _find_item(self, key: int) -> (bytes, int):
+        if key not in self.index:
+            return False, len(consts.NORCOW_MAGIC_AND_VERSION)
+        pos, length = self.index[key]
+        value = self.sectors[self.active_sector][pos + 4 : pos + 4 + length]
         return value, pos
 
     def _get_all_keys(self) -> (bytes, int):
-        offset = len(consts.NORCOW_MAGIC_AND_VERSION)
-        keys = set()
-        while True:
-            try:
-                k, v = self._read_item(offset)
-                keys.add(k)
-            except ValueError:
-                break
-            offset = offset + self._norcow_item_length(v)
-        return keys
+        return set(self.index)
 
     def _norcow_item_length(self, data: bytes) -> int:
         # APP_ID, KEY_ID, LENGTH, DATA, ALIGNMENT
         return 1 + 1 + 2 + len(data) + align4_int(len(data))
 
-    def _read_item(self, offset: int) -> (int, bytes):
-        key = self.sectors[self.active_sector][offset : offset + 2]
-        key = int.from_bytes(key, sys.byteorder)
+    def _read_item(self, offset: int) -> (int, memoryview):
+        sector = self.sectors[self.active_sector]
+        key = int.from_bytes(sector[offset : offset + 2], sys.byteorder)
         if key == consts.NORCOW_KEY_FREE:
             raise ValueError("Norcow: no data on this offset")
-        length = self.sectors[self.active_sector][offset + 2 : offset + 4]
-        length = int.from_bytes(length, sys.byteorder)
-        value = self.sectors[self.active_sector][offset + 4 : offset + 4 + length]
-        return key, value
+        length = int.from_bytes(sector[offset + 2 : offset + 4], sys.byteorder)
+        return key, sector[offset + 4 : offset + 4 + length]
 
     def _compact(self):
-        offset = len(consts.NORCOW_MAGIC_AND_VERSION)
         data = list()
-        while True:
-            try:
-                k, v = self._read_item(offset)
-                if k != 0x00:
-                    data.append((k, v))
-            except ValueError:
-                break
-            offset = offset + self._norcow_item_length(v)
+        for offset, _ in sorted(self.index.values()):
+            k, v = self._read_item(offset)
+            if k != 0x00:
+                # copy the value, wipe() erases the buffer it points to
+                data.append((k, bytes(v)))
         sector = self.active_sector
         self.wipe((sector + 1) % consts.NORCOW_SECTOR_COUNT)
         for key, value in data:
@@ -168,7 +208,85 @@ class Norcow:
             consts.NORCOW_SECTOR_SIZE,
         ]:
             raise RuntimeError("Norcow: set_sectors called with invalid data length")
-        self.sectors = [bytearray(sector) for sector in data]
+        self._allocate()
+        for sector, sector_data in zip(self.sectors, data):
+            sector[:] = sector_data
+        self.page_digests = None
+        if hasattr(self, "active_sector"):
+            self.active_offset = self._build_index()
+
+    def _allocate(self):
+        if self.buffer is not None:
+            return
+        self.buffer = bytearray(ERASED_FLASH)
+        view = memoryview(self.buffer)
+        self.sectors = [
+            view[i * consts.NORCOW_SECTOR_SIZE : (i + 1) * consts.NORCOW_SECTOR_SIZE]
+            for i in range(consts.NORCOW_SECTOR_COUNT)
+        ]
+
+    def _mark_pages(self, sector: int, pos: int, length: int):
+        if self.page_digests is None:
+            return
+        first = pos // DIGEST_PAGE_SIZE
+        last = (pos + length - 1) // DIGEST_PAGE_SIZE
+        self.dirty[sector].update(range(first, last + 1))
+
+    def _refresh_digests(self, sector: int):
+        if self.page_digests is None:
+            self.page_digests = [
+                [0] * DIGEST_PAGE_COUNT for _ in range(consts.NORCOW_SECTOR_COUNT)
+            ]
+            digest = 0
+            for page in range(DIGEST_PAGE_COUNT):
+                digest ^= mix_page_digest(page, 0)
+            self.sector_digests = [digest] * consts.NORCOW_SECTOR_COUNT
+            self.dirty = [
+                set(range(DIGEST_PAGE_COUNT)) for _ in range(consts.NORCOW_SECTOR_COUNT)
+            ]
+        digests = self.page_digests[sector]
+        for page in self.dirty[sector]:
+            start = page * DIGEST_PAGE_SIZE
+            digest = page_digest(self.sectors[sector][start : start + DIGEST_PAGE_SIZE])
+            self.sector_digests[sector] ^= mix_page_digest(
+                page, digests[page]
+            ) ^ mix_page_digest(page, digest)
+            digests[page] = digest
+        self.dirty[sector].clear()
+
+    def _digest(self):
+        """
+        Returns the digests of the sectors, rehashing only the pages written
+        since the previous call.
+        """
+        for sector in range(consts.NORCOW_SECTOR_COUNT):
+            self._refresh_digests(sector)
+        return list(self.sector_digests)
+
+    def _page_digest(self, sector: int, page: int) -> int:
+        self._refresh_digests(sector)
+        return self.page_digests[sector][page]
+
+    def _dirty_pages(self):
+        if self.page_digests is None:
+            return [list(range(DIGEST_PAGE_COUNT)) for _ in self.sectors]
+        return [sorted(pages) for pages in self.dirty]
 
     def _dump(self):
-        return [bytes(sector) for sector in self.sectors]
+        """
+        Returns read-only views of the sectors, they follow later writes.
+        """
+        return [sector.toreadonly() for sector in self.sectors]
+
+    def _equals(self, data) -> bool:
+        """
+        Compares the sectors with the given sector buffers without copying.
+        """
+        if self.sectors is None or len(data) != len(self.sectors):
+            return False
+        for i, sector_data in enumerate(data):
+            if len(sector_data) != consts.NORCOW_SECTOR_SIZE:
+                return False
+            if not self.buffer.startswith(sector_data, i * consts.NORCOW_SECTOR_SIZE):
+                return False
+        return True
@@ -14,6 +14,10 @@ class Storage:
         self.sak = None
         self.nc = Norcow()
         self.pin_log = PinLog(self.nc)
+        # Protected keys present in norcow and the XOR of their HMACs, which is
+        # maintained incrementally and rebuilt lazily once SAK changes.
+        self.protected_keys = set()
+        self.hmacs = None
 
     def init(self, hardware_salt: bytes = b""):
         """
@@ -23,6 +27,10 @@ class Storage:
         """
         self.nc.init()
         self.initialized = True
+        self.protected_keys = {
+            key for key in self.nc._get_all_keys() if consts.is_app_protected(key >> 8)
+        }
+        self.hmacs = None
         self.hw_salt_hash = hashlib.sha256(hardware_salt).digest()
 
         edek_esak_pvc = self.nc.get(consts.EDEK_ESEK_PVC_KEY)
@@ -36,6 +44,7 @@ class Storage:
         """
         self.dek = prng.random_buffer(consts.DEK_SIZE)
         self.sak = prng.random_buffer(consts.SAK_SIZE)
+        self.hmacs = None
 
         self.nc.set(consts.SAT_KEY, crypto.init_hmacs(self.sak))
         self._set_encrypt(consts.VERSION_KEY, b"\x01\x00\x00\x00")
@@ -61,6 +70,7 @@ class Storage:
 
     def wipe(self):
         self.nc.wipe()
+        self.protected_keys = set()
         self._init_pin()
 
     def check_pin(self, pin: int) -> bool:
@@ -76,6 +86,7 @@ class Storage:
             self.pin_log.write_success()
             self.dek = dek
             self.sak = sak
+            self.hmacs = None
             return True
         except crypto.InvalidPinError:
             fails = self.pin_log.get_failures_count()
@@ -123,6 +134,15 @@ class Storage:
             return self.nc.get(key)
         return self._get_encrypted(key)
 
+    def get_many(self, keys) -> list:
+        vals = []
+        for key in keys:
+            try:
+                vals.append(self.get(key) if self.nc.get(key) is not False else None)
+            except RuntimeError:
+                vals.append(None)
+        return vals
+
     def set(self, key: int, val: bytes) -> bool:
         app = key >> 8
         self._check_lock(app)
@@ -130,6 +150,10 @@ class Storage:
             return self.nc.set(key, val)
         return self._set_encrypt(key, val)
 
+    def set_many(self, items) -> None:
+        for key, val in items:
+            self.set(key, val)
+
     def set_counter(self, key: int, val: int):
         app = key >> 8
         if not consts.is_app_public(app):
@@ -169,6 +193,7 @@ class Storage:
         self._check_lock(app)
         ret = self.nc.delete(key)
         if consts.is_app_protected(app):
+            self._update_authentication(key, False)
             sat = self._calculate_authentication_tag()
             self.nc.set(consts.SAT_KEY, sat)
         return ret
@@ -209,6 +234,7 @@ class Storage:
         )
         self.nc.set(key, preallocate)
         if consts.is_app_protected(key >> 8):
+            self._update_authentication(key, True)
             sat = self._calculate_authentication_tag()
             self.nc.set(consts.SAT_KEY, sat)
 
@@ -218,14 +244,26 @@ class Storage:
         )
         return self.nc.replace(key, iv + tag + cipher_text)
 
+    def _update_authentication(self, key: int, present: bool):
+        if present == (key in self.protected_keys):
+            return
+        if present:
+            self.protected_keys.add(key)
+        else:
+            self.protected_keys.remove(key)
+        if self.hmacs is not None:
+            self.hmacs = crypto.xor_hmac(
+                self.sak, self.hmacs, key.to_bytes(2, sys.byteorder)
+            )
+
     def _calculate_authentication_tag(self) -> bytes:
-        keys = []
-        for key in self.nc._get_all_keys():
-            if consts.is_app_protected(key >> 8):
-                keys.append(key.to_bytes(2, sys.byteorder))
-        if not keys:
-            return crypto.init_hmacs(self.sak)
-        return crypto.calculate_hmacs(self.sak, keys)
+        if self.hmacs is None:
+            self.hmacs = crypto.empty_hmacs()
+            for key in self.protected_keys:
+                self.hmacs = crypto.xor_hmac(
+                    self.sak, self.hmacs, key.to_bytes(2, sys.byteorder)
+                )
+        return crypto.final_hmacs(self.sak, self.hmacs)
 
     def _set_bool(self, key: int, val: bool) -> bool:
         if val:
@@ -235,3 +273,15 @@ class Storage:
 
     def _dump(self) -> bytes:
         return self.nc._dump()
+
+    def _memory_equals(self, sectors) -> bool:
+        return self.nc._equals(sectors)
+
+    def _digest(self) -> list:
+        return self.nc._digest()
+
+    def _page_digest(self, sector: int, page: int) -> int:
+        return self.nc._page_digest(sector, page)
+
+    def _dirty_pages(self) -> list:
+        return self.nc._dirty_pages()
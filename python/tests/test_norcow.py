@@ -153,3 +153,37 @@ def test_norcow_compact():
 
     assert n.get(0x0101) == b"hello"
     assert n.get(0x0103) == b"123456789x"
+
+
+def test_norcow_equals():
+    n = norcow.Norcow()
+    n.init()
+    n.set(0x0101, b"hello")
+    copy = [bytes(sector) for sector in n._dump()]
+    assert n._equals(copy)
+
+    m = norcow.Norcow()
+    m._set_sectors(copy)
+    assert n._equals(m._dump())
+
+    n.set(0x0102, b"world")
+    assert not n._equals(copy)
+    assert not n._equals(copy[:1])
+    assert not n._equals([copy[0], copy[1][:-1]])
+
+
+def test_norcow_digest():
+    n = norcow.Norcow()
+    n.init()
+    n.set(0x0101, b"hello")
+    d = n._digest()
+    assert n._dirty_pages() == [[], []]
+
+    n.set(0x0102, b"a" * 300)
+    assert n._dirty_pages() == [[0, 1], []]
+    assert n._digest() != d
+
+    m = norcow.Norcow()
+    m._set_sectors(n._dump())
+    assert m._digest() == n._digest()
+    assert m._page_digest(0, 1) == n._page_digest(0, 1)
@@ -0,0 +1,35 @@
+import pytest
+
+from c import storage as storage_c
+from python.src import crypto
+
+
+def pytest_configure(config):
+    config.addinivalue_line(
+        "markers", "real_kdf: run with the PIN key derivation cache disabled"
+    )
+
+
+@pytest.fixture(autouse=True, scope="session")
+def kdf_cache():
+    # the tests unlock with the same PINs over and over, memoize the PBKDF2
+    storage_c.enable_kdf_cache()
+    crypto.enable_kdf_cache()
+    yield
+    storage_c.enable_kdf_cache(False)
+    crypto.enable_kdf_cache(False)
+
+
+@pytest.fixture(autouse=True)
+def real_kdf(request, kdf_cache):
+    # tests marked real_kdf go through the uncached derivation, so the cache
+    # cannot hide a broken PIN path
+    if not request.node.get_closest_marker("real_kdf"):
+        yield
+        return
+    derive = crypto.derive_kek_keiv
+    storage_c.enable_kdf_cache(False)
+    crypto.enable_kdf_cache(False)
+    yield
+    storage_c.enable_kdf_cache()
+    crypto.derive_kek_keiv = derive
@@ -1,5 +1,9 @@
+import random
+import struct
+
 import pytest
 
+from c0.storage import Storage as StorageC0
 from python.src import consts
 
 from . import common
@@ -30,3 +34,51 @@ def test_compact():
             s.set(0x0101, b"a" * (consts.NORCOW_SECTOR_SIZE - 100))
         s.set(0x0101, b"hello")
     assert common.memory_equals(sc, sp)
+
+
+def items_c0(sector: bytes) -> list:
+    # (key, value) of the items of a c0 sector without commit words
+    items, pos = [], 4
+    while pos + 4 <= len(sector):
+        key, length = struct.unpack_from("<HH", sector, pos)
+        if key == 0xFFFF:
+            break
+        items.append((key, sector[pos + 4 : pos + 4 + length]))
+        pos += 4 + (length + 3) // 4 * 4
+    return items
+
+
+def sector_c0(items: list) -> bytes:
+    data = b"NRCW"
+    for key, val in items:
+        data += struct.pack("<HH", key, len(val)) + val + bytes(-len(val) % 4)
+    return data + b"\xff" * (consts.NORCOW_SECTOR_SIZE - len(data))
+
+
+def compact_c0(items: list) -> list:
+    # reference compaction: the latest item of every key, in the order of
+    # the first appearance of the keys
+    latest = dict(items)
+    return [(key, latest[key]) for key in dict.fromkeys(key for key, _ in items)]
+
+
+@pytest.mark.parametrize("keys", [40, 2000])
+def test_compact_c0(keys):
+    # the compaction lays the sector out exactly as the reference
+    rnd = random.Random(keys)
+    s = StorageC0()
+    s.init()
+    assert s.unlock(1)
+    for _ in range(3):
+        while True:
+            before = s._dump()
+            active = next(i for i, d in enumerate(before) if d[:4] == b"NRCW")
+            key = 0x0100 + rnd.randrange(keys)
+            val = rnd.randbytes(rnd.choice([0, 1, 4, 7, 30]))
+            s.set(key, val)
+            after = s._dump()
+            if after[active][:4] != b"NRCW":
+                break
+        assert before[active] == sector_c0(items_c0(before[active]))
+        expected = sector_c0(compact_c0(items_c0(before[active])) + [(key, val)])
+        assert after[1 - active] == expected
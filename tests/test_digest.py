@@ -0,0 +1,30 @@
+from python.src.norcow import Norcow
+
+from . import common
+
+
+def test_digest_matches_python():
+    sc, sp = common.init(unlock=True)
+    assert common.memory_equals(sc, sp)
+    for s in (sc, sp):
+        s.set(0xBEEF, b"hello")
+    assert sc._dirty_pages() == sp._dirty_pages()
+    assert common.memory_equals(sc, sp)
+    assert sc._dirty_pages() == sp._dirty_pages() == [[], []]
+
+    for i in range(200):
+        for s in (sc, sp):
+            s.set(0x0101, bytes([i]) * 1000)
+    assert common.memory_equals(sc, sp)
+    assert common.diverging_pages(sc, sp) == []
+
+
+def test_digest_diverging_page():
+    sc, sp = common.init(unlock=True)
+    sn = Norcow()
+    sn._set_sectors(sp._dump())
+    sn.active_sector = 0
+    sn._write(0x1234, 0x0102, b"diverged")
+    assert sn._digest() != sp._digest()
+    assert common.diverging_pages(sn, sp) == [(0, 0x1234 // 256)]
+    assert common.diverging_pages(sc, sp) == []
@@ -0,0 +1,52 @@
+from c0.storage import Storage as StorageC0
+from c.storage import Storage as StorageC
+
+from . import common
+
+
+def test_persistent_image(tmp_path):
+    image = str(tmp_path / "flash.bin")
+    sc = StorageC(image, persistent=True)
+    sc.init(common.test_uid)
+    assert sc.unlock(1)
+    sc.set(0xBEEF, b"hello")
+    dump = sc._dump()
+    del sc
+
+    sc = StorageC(image)
+    assert sc._dump() == dump
+    sc.init(common.test_uid)
+    assert sc.unlock(1)
+    assert sc.get(0xBEEF) == b"hello"
+    sc.set(0xBEEF, b"private")
+    del sc
+
+    # changes to a private mapping are not written to the image
+    sc = StorageC(image)
+    assert sc._dump() == dump
+
+
+def test_persistent_image_c0(tmp_path):
+    image = str(tmp_path / "flash0.bin")
+    sc0 = StorageC0(image, persistent=True)
+    sc0.init()
+    assert sc0.unlock(1)
+    sc0.set(0xBEEF, b"hello")
+    dump = sc0._dump()
+    del sc0
+
+    sc0 = StorageC0(image)
+    sc0.init()
+    assert sc0.unlock(1)
+    assert sc0.get(0xBEEF) == b"hello"
+    sc0.set(0xBEEF, b"private")
+    del sc0
+
+    sc0 = StorageC0(image)
+    assert sc0._dump() == dump
+
+    # images captured from the older storage can be upgraded in place
+    sc = StorageC(image)
+    sc.init(common.test_uid)
+    assert sc.unlock(1)
+    assert sc.get(0xBEEF) == b"hello"
@@ -0,0 +1,42 @@
+from c0.storage import Storage as StorageC0
+from python.src import consts
+
+from . import common
+
+
+def test_flash_stats():
+    sc, _ = common.init(unlock=True)
+    sc._reset_flash_stats()
+    sc.set(0x8101, b"a" * (consts.NORCOW_SECTOR_SIZE // 2))
+    sc.set(0x8101, b"b" * (consts.NORCOW_SECTOR_SIZE // 2))
+    stats = sc._get_flash_stats()
+    # the second set compacts into sector 16 and erases sector 4
+    assert stats.erase_count[4] == 1
+    assert stats.erase_count[16] == 1
+    assert stats.programmed_bytes >= consts.NORCOW_SECTOR_SIZE
+    assert stats.rejected_writes == 0
+
+    sc._reset_flash_stats()
+    assert sc.get(0x8101) == b"b" * (consts.NORCOW_SECTOR_SIZE // 2)
+    stats = sc._get_flash_stats()
+    assert stats.read_bytes > 0
+    assert stats.byte_writes + stats.word_writes == 0
+
+
+def test_flash_stats_c0():
+    sc0 = StorageC0()
+    sc0.init()
+    assert sc0.unlock(1)
+    sc0._reset_flash_stats()
+    sc0.set(0x0101, bytes(range(100)))
+    stats = sc0._get_flash_stats()
+    # prefix and 25 data words, no byte writes for aligned values
+    assert stats.word_writes == 26
+    assert stats.byte_writes == 0
+    assert stats.programmed_bytes == 104
+
+    sc0._reset_flash_stats()
+    sc0.wipe()
+    stats = sc0._get_flash_stats()
+    assert list(stats.erase_count).count(1) == 2
+    assert stats.erase_count[4] == stats.erase_count[16] == 1
@@ -0,0 +1,39 @@
+import pytest
+
+from c.storage import (
+    FLASH_TRACE_ERASE,
+    FLASH_TRACE_READ,
+    FLASH_TRACE_WRITE_WORD,
+    read_flash_trace,
+)
+
+from . import common
+
+
+def test_flash_trace(tmp_path):
+    path = str(tmp_path / "flash.trace")
+    sc, _ = common.init(unlock=True)
+    sc._reset_flash_stats()
+    sc._trace_start(path)
+    sc.set(0x8101, b"hello")
+    assert sc.get(0x8101) == b"hello"
+    sc.wipe()
+    sc._trace_stop()
+
+    events = list(read_flash_trace(path))
+    assert [e.seq for e in events] == list(range(len(events)))
+    ops = [e.op for e in events]
+    stats = sc._get_flash_stats()
+    assert ops.count(FLASH_TRACE_WRITE_WORD) == stats.word_writes
+    assert ops.count(FLASH_TRACE_ERASE) == sum(stats.erase_count)
+    assert sum(e.len for e in events if e.op == FLASH_TRACE_READ) == stats.read_bytes
+    assert {e.sector for e in events if e.op == FLASH_TRACE_ERASE} == {4, 16}
+
+
+def test_flash_trace_write_error():
+    # a trace which could not be written is reported at the stop
+    sc, _ = common.init(unlock=True)
+    sc._trace_start("/dev/full")
+    sc.set(0x8101, b"hello")
+    with pytest.raises(RuntimeError):
+        sc._trace_stop()
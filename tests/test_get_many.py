@@ -0,0 +1,39 @@
+from c0.storage import Storage as StorageC0
+
+from . import common
+
+
+def test_get_many():
+    sc, sp = common.init(unlock=True)
+    keys = [0x0100 + i for i in range(20)] + [0x8101]
+    for s in (sc, sp):
+        for key in keys[::2]:
+            s.set(key, key.to_bytes(2, "big") * 3)
+        s.set(0x0100, b"")
+    for s in (sc, sp):
+        vals = s.get_many(keys + [0x0102, 0x0001])
+        assert vals[0] == b""
+        assert vals[1] is None
+        assert vals[2] == vals[-2] == b"\x01\x02" * 3
+        assert vals[-1] is None
+        assert vals[:-2] == [
+            s.get(k) if i % 2 == 0 else None for i, k in enumerate(keys)
+        ]
+        assert s.get_many([]) == []
+
+
+def test_get_many_c0():
+    sc0 = StorageC0()
+    sc0.init()
+    assert sc0.unlock(1)
+    keys = [0x0100 + i for i in range(20)] + [0x8101]
+    for key in keys[1:]:
+        sc0.set(key, key.to_bytes(2, "big") * 3)
+    vals = sc0.get_many(keys + [0x0001])
+    assert vals[0] is None
+    assert vals[1:-1] == [sc0.get(key) for key in keys[1:]]
+    assert vals[-1] is None
+
+    # only the public keys can be read from a locked storage
+    sc0.init()
+    assert sc0.get_many([0x0101, 0x8101]) == [None, b"\x81\x01" * 3]
@@ -0,0 +1,207 @@
+import random
+
+import pytest
+
+from c0.storage import Storage as StorageC0
+
+HOT_KEYS = [0x0001, 0x0101, 0x0102]
+# flash sectors of the cold and the hot generation
+COLD_SECTORS = [4, 16]
+HOT_SECTORS = [3, 15]
+
+
+def new_storage(flash: bytes = None, **options) -> StorageC0:
+    s = StorageC0(**options)
+    if flash is not None:
+        s._set_flash_buffer(flash)
+    s._reset_flash_stats()
+    s.init()
+    assert s.unlock(1)
+    return s
+
+
+def erases(s, sectors) -> int:
+    stats = s._get_flash_stats()
+    return sum(stats.erase_count[i] for i in sectors)
+
+
+def test_hot_keys():
+    s = new_storage(hot_keys=HOT_KEYS)
+    cold = {0x0200 + i: bytes([i]) * 500 for i in range(40)}
+    s.set_many(cold.items())
+    for i in range(2000):
+        s.set(0x0101, i.to_bytes(4, "little"))
+        s.set(0x0102, bytes([i % 256]) * 40)
+    # the churn compacts only the hot generation
+    assert erases(s, HOT_SECTORS) > 10
+    assert erases(s, COLD_SECTORS) == 2
+    assert s.get(0x0101) == (1999).to_bytes(4, "little")
+    assert s.get_many(cold.keys()) == list(cold.values())
+
+    s = new_storage(s._get_flash_buffer(), hot_keys=HOT_KEYS)
+    assert s.get(0x0101) == (1999).to_bytes(4, "little")
+    assert s.get(0x0102) == bytes([1999 % 256]) * 40
+    assert s.get_many(cold.keys()) == list(cold.values())
+
+
+def test_hot_keys_pin_counter():
+    s = new_storage(hot_keys=HOT_KEYS)
+    s.set(0x0200, b"seed" * 100)
+    for _ in range(200):
+        assert s.unlock(1)
+    assert not s.unlock(2)
+    flash = s._get_flash_buffer()
+    # the PIN fail counter is kept by the hot generation
+    hot = flash[0x00C000 : 0x00C000 + 0x4000] + flash[0x10C000 : 0x10C000 + 0x4000]
+    assert b"\x01\x00\x80\x00" in hot
+    assert erases(s, COLD_SECTORS) == 2
+
+    s = new_storage(flash, hot_keys=HOT_KEYS)
+    assert s.get(0x0200) == b"seed" * 100
+
+
+def test_hot_keys_unused():
+    s = new_storage()
+    s.set(0x0101, b"cold")
+    flash = s._get_flash_buffer()
+    # the hot generation is not touched without hot keys
+    assert flash[0x00C000 : 0x00C000 + 0x4000] == b"\x00" * 0x4000
+    assert flash[0x10C000 : 0x10C000 + 0x4000] == b"\x00" * 0x4000
+
+
+def test_hot_keys_last_bit():
+    # keys in the last bit of a bitmap word, 0x011F % 32 == 31
+    s = new_storage()
+    s.set(0x011F, b"last")
+    s.set(0x01FF, b"end")
+    s = new_storage(s._get_flash_buffer(), hot_keys=[0x011F, 0x01FF])
+    assert s.get(0x011F) == b"last"
+    assert s.get(0x01FF) == b"end"
+    flash = s._get_flash_buffer()
+    hot = flash[0x00C000 : 0x00C000 + 0x4000] + flash[0x10C000 : 0x10C000 + 0x4000]
+    assert b"last" in hot and b"end" in hot
+
+
+@pytest.mark.parametrize("tail_records", [False, True])
+def test_hot_keys_change(tail_records):
+    s = new_storage(tail_records=tail_records)
+    s.set(0x0101, b"before")
+    s.set(0x0103, b"cold")
+    # the hot keys are moved into the hot generation
+    s = new_storage(s._get_flash_buffer(), tail_records=tail_records, hot_keys=HOT_KEYS)
+    assert s.get(0x0101) == b"before"
+    assert s.get(0x0103) == b"cold"
+    s.set(0x0101, b"hot")
+    for i in range(200):
+        s.set(0x0102, bytes([i]) * 200)
+
+    # a key which is no longer hot is moved back
+    s = new_storage(s._get_flash_buffer(), tail_records=tail_records, hot_keys=[0x0102])
+    assert s.get(0x0101) == b"hot"
+    assert s.get(0x0102) == bytes([199]) * 200
+    s.set(0x0101, b"cold again")
+
+    # and all of them without hot keys
+    s = new_storage(s._get_flash_buffer(), tail_records=tail_records)
+    assert erases(s, HOT_SECTORS) == 2
+    assert s.get(0x0101) == b"cold again"
+    assert s.get(0x0102) == bytes([199]) * 200
+    assert s.get(0x0103) == b"cold"
+
+    s = new_storage(s._get_flash_buffer(), tail_records=tail_records, hot_keys=HOT_KEYS)
+    assert s.get(0x0101) == b"cold again"
+    assert s.get(0x0102) == bytes([199]) * 200
+
+
+def ops(s) -> int:
+    stats = s._get_flash_stats()
+    return stats.byte_writes + stats.word_writes + sum(stats.erase_count)
+
+
+@pytest.mark.parametrize("tail_records", [False, True])
+def test_hot_keys_move_reset(tail_records):
+    val = bytes(range(256)) * 8
+    s = new_storage(tail_records=tail_records)
+    s.set(0x0108, val)
+    s.set(0x0109, b"cold")
+    cold = s._get_flash_buffer()
+    s = new_storage(cold, tail_records=tail_records, hot_keys=[0x0108])
+    hot = s._get_flash_buffer()
+
+    # a reset at every flash operation of the init which moves the key into
+    # the hot generation and back
+    for flash, hot_keys in ((cold, [0x0108]), (hot, [])):
+        s = StorageC0(tail_records=tail_records, hot_keys=hot_keys)
+        s._set_flash_buffer(flash)
+        s._reset_flash_stats()
+        s.init()
+        for n in range(ops(s)):
+            s = StorageC0(tail_records=tail_records, hot_keys=hot_keys)
+            s._set_flash_buffer(flash)
+            s._power_cut(n)
+            s.init()
+            s = new_storage(
+                s._get_flash_buffer(), tail_records=tail_records, hot_keys=hot_keys
+            )
+            assert s.get(0x0108) == val
+            assert s.get(0x0109) == b"cold"
+
+
+def test_hot_keys_maintenance():
+    s = new_storage(hot_keys=HOT_KEYS)
+    s.set(0x0200, b"cold")
+    for i in range(120):
+        s.set(0x0101, bytes([i]) * 100)
+    assert erases(s, HOT_SECTORS) == 2
+    assert not s.maintenance(1)
+    s.set(0x0101, b"during")
+    while not s.maintenance(1):
+        pass
+    assert erases(s, HOT_SECTORS) == 4
+    assert erases(s, COLD_SECTORS) == 2
+    s = new_storage(s._get_flash_buffer(), hot_keys=HOT_KEYS)
+    assert s.get(0x0101) == b"during"
+    assert s.get(0x0200) == b"cold"
+
+
+def test_hot_keys_stream():
+    s = new_storage(hot_keys=HOT_KEYS)
+    s.set_begin(0x0101, 3000)
+    for i in range(3):
+        s.set_append(bytes([i]) * 1000)
+    s.set_commit()
+    assert s.get(0x0101) == b"\x00" * 1000 + b"\x01" * 1000 + b"\x02" * 1000
+    with pytest.raises(RuntimeError):
+        s.set_begin(0x0101, 0x4000)
+
+
+@pytest.mark.parametrize("index_summary", [False, True])
+def test_hot_keys_random(index_summary):
+    rnd = random.Random(index_summary)
+    options = dict(index_summary=index_summary, tail_records=True)
+    hot_keys = HOT_KEYS
+    s = new_storage(hot_keys=hot_keys, **options)
+    vals = {}
+    for i in range(4000):
+        key = rnd.choice(HOT_KEYS[1:] + [0x0110 + rnd.randrange(40)])
+        vals[key] = rnd.randbytes(rnd.choice([0, 4, 30, 300]))
+        s.set(key, vals[key])
+        if i % 10 == 0:
+            s.maintenance(2)
+        if i % 700 == 0:
+            hot_keys = rnd.choice([HOT_KEYS, HOT_KEYS[:2], [0x0110, 0x0111], []])
+            s = new_storage(s._get_flash_buffer(), hot_keys=hot_keys, **options)
+            assert s.get_many(vals.keys()) == list(vals.values())
+    assert s.get_many(vals.keys()) == list(vals.values())
+
+
+def test_hot_keys_dump():
+    # the dump covers the hot generation too
+    s = new_storage(hot_keys=HOT_KEYS)
+    before = s._dump()
+    assert [len(d) for d in before] == [0x10000, 0x10000, 0x4000, 0x4000]
+    s.set(0x0101, b"hot")
+    after = s._dump()
+    assert after[:2] == before[:2]
+    assert after[2:] != before[2:]
+    assert any(b"hot" in d for d in after[2:])
@@ -0,0 +1,158 @@
+import random
+import struct
+
+import pytest
+
+from c0.storage import Storage as StorageC0
+
+SUMMARY_KEY = 0x00FF
+SECTORS = (0x010000, 0x110000)
+
+
+def new_storage(flash: bytes = None, **options) -> StorageC0:
+    s = StorageC0(**options)
+    if flash is not None:
+        s._set_flash_buffer(flash)
+    s.init()
+    assert s.unlock(1)
+    return s
+
+
+def active_sector(s) -> int:
+    return next(i for i, d in enumerate(s._dump()) if d[:3] == b"NRC")
+
+
+def summary(s) -> list:
+    # the words of the index summary in the active sector, None if missing
+    data = s._dump()[active_sector(s)]
+    key, length = struct.unpack_from("<HH", data, 4)
+    if key != SUMMARY_KEY:
+        return None
+    return list(struct.unpack_from("<%dI" % (length // 4), data, 8))
+
+
+def fill(s, rnd, vals, count):
+    for _ in range(count):
+        key = 0x0100 + rnd.randrange(600)
+        vals[key] = rnd.randbytes(rnd.choice([0, 1, 4, 30, 200]))
+        s.set(key, vals[key])
+
+
+def check(s, vals):
+    assert s.get_many(vals.keys()) == list(vals.values())
+
+
+@pytest.mark.parametrize("tail_records", [False, True])
+def test_index_summary(tail_records):
+    rnd = random.Random(tail_records)
+    s = new_storage(index_summary=True, tail_records=tail_records)
+    vals = {}
+    fill(s, rnd, vals, 1000)
+    assert summary(s) is None
+    fill(s, rnd, vals, 1000)
+    words = summary(s)
+    assert words is not None
+    covered, garbage = words[:2]
+    assert garbage == 0
+    entries = [w for w in words[2:] if w]
+    assert len(entries) == len(words) - 2
+    assert all(4 < w >> 16 < covered for w in entries)
+
+    fill(s, rnd, vals, 50)
+    for options in ({}, {"index_summary": True, "tail_records": tail_records}):
+        s = new_storage(s._get_flash_buffer(), **options)
+        check(s, vals)
+    assert s.unlock(1)
+    assert s.maintenance(1000)
+
+    # the summary is dropped by a compaction without it
+    s = new_storage(s._get_flash_buffer(), tail_records=tail_records)
+    fill(s, rnd, vals, 2000)
+    assert summary(s) is None
+    check(s, vals)
+
+
+def test_index_summary_invalid():
+    rnd = random.Random(1)
+    s = new_storage(index_summary=True)
+    vals = {}
+    fill(s, rnd, vals, 2000)
+    assert summary(s) is not None
+
+    # an entry pointing to another item is detected
+    flash = bytearray(s._get_flash_buffer())
+    entry = SECTORS[active_sector(s)] + 16
+    first, second = struct.unpack_from("<II", flash, entry)
+    struct.pack_into("<I", flash, entry, (second & 0xFFFF0000) | (first & 0xFFFF))
+    s = new_storage(bytes(flash))
+    check(s, vals)
+
+
+def test_index_summary_incremental():
+    rnd = random.Random(2)
+    s = new_storage(index_summary=True)
+    vals = {}
+    for i in range(60):
+        vals[0x0100 + i % 6] = bytes([i]) * 1000
+        s.set(0x0100 + i % 6, vals[0x0100 + i % 6])
+    assert s.maintenance(0) is False
+    steps = 0
+    while not s.maintenance(2):
+        # keys added meanwhile do not fit the reserved summary
+        steps += 1
+        vals[0x0200 + steps] = rnd.randbytes(10)
+        s.set(0x0200 + steps, vals[0x0200 + steps])
+        vals[0x0101] = bytes([steps])
+        s.set(0x0101, vals[0x0101])
+    words = summary(s)
+    assert words is not None
+    assert len(words) == 2 + 7
+    check(s, vals)
+    s = new_storage(s._get_flash_buffer())
+    check(s, vals)
+
+
+@pytest.mark.parametrize("index_summary", [False, True])
+@pytest.mark.parametrize("tail_records", [False, True])
+def test_index_overflow(index_summary, tail_records):
+    # more keys than the RAM index has room for, the others are scanned for
+    rnd = random.Random(index_summary * 2 + tail_records)
+    options = dict(index_summary=index_summary, tail_records=tail_records)
+    s = new_storage(**options)
+    vals = {}
+    for i in range(20000):
+        key = 0x0100 + rnd.randrange(1000)
+        vals[key] = rnd.randbytes(rnd.choice([0, 4, 12]))
+        s.set(key, vals[key])
+        if i % 10 == 0:
+            s.maintenance(2)
+    assert len(vals) > 768
+    assert sum(s._get_flash_stats().erase_count) > 6
+    check(s, vals)
+    assert [s.get(key) for key in vals] == list(vals.values())
+    while not s.maintenance(5):
+        pass
+    check(s, vals)
+    s = new_storage(s._get_flash_buffer(), **options)
+    check(s, vals)
+
+
+def compaction_reads(keys: int) -> int:
+    # bytes read by the set which compacts a sector of given distinct keys
+    s = new_storage()
+    for i in range(keys):
+        s.set(0x0100 + i, struct.pack("<I", i))
+    for i in range(100):
+        s._reset_flash_stats()
+        s.set(0xF001, bytes([i]) * 4096)
+        stats = s._get_flash_stats()
+        if sum(stats.erase_count):
+            return stats.read_bytes
+    raise AssertionError("no compaction")
+
+
+def test_index_overflow_compaction():
+    # keys beyond the RAM index are copied by further passes, not looked up
+    # one by one, so the reads grow linearly with the keys
+    small, large = compaction_reads(1000), compaction_reads(6000)
+    assert large / 6000 < 2 * small / 1000
@@ -0,0 +1,75 @@
+import gc
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+
+from c0 import storage as c0_storage
+from c0.storage import Storage as StorageC0
+
+from . import common
+
+
+def test_independent_instances():
+    sc1, sp1 = common.init(unlock=True)
+    sc2, sp2 = common.init(unlock=True)
+    for s in (sc1, sp1):
+        s.set(0xBEEF, b"first")
+    for s in (sc2, sp2):
+        s.set(0xBEEF, b"second")
+        s.change_pin(1, 2)
+    assert common.memory_equals(sc1, sp1)
+    assert common.memory_equals(sc2, sp2)
+    assert sc1.get(0xBEEF) == b"first"
+    assert sc2.get(0xBEEF) == b"second"
+
+
+def test_independent_instances_c0():
+    storages = [StorageC0() for _ in range(4)]
+    for s in storages:
+        s.init()
+        assert s.unlock(1)
+
+    def run(i):
+        s = storages[i]
+        for j in range(160):
+            s.set(0x0100 + j % 16, bytes([i]) * (j + i))
+        return [s.get(0x0100 + j) for j in range(16)]
+
+    with ThreadPoolExecutor(len(storages)) as executor:
+        results = list(executor.map(run, range(len(storages))))
+    for i, values in enumerate(results):
+        for j, val in enumerate(values):
+            assert val == bytes([i]) * (144 + j + i)
+
+
+def test_pooled_instances_c0():
+    # a pooled library starts the next instance with a clean emulator
+    s = StorageC0()
+    lib = s.lib
+    default = bytes(s._get_flash_timing())
+    timing = s._get_flash_timing()
+    timing.word_program_us = 100
+    s._set_flash_timing(timing)
+    s.init()
+    assert s.unlock(1)
+    s.set(0x0101, b"hello")
+    sid = s._snapshot()
+    s._power_cut(0)
+    del s
+    gc.collect()
+
+    # take instances until the library is reused, the pool may hold others
+    assert lib in c0_storage._libs
+    others = []
+    s = StorageC0()
+    while s.lib is not lib:
+        others.append(s)
+        s = StorageC0()
+    assert bytes(s._get_flash_timing()) == default
+    assert s._get_clock() == 0
+    assert bytes(s._get_flash_stats()) == bytes(len(bytes(s._get_flash_stats())))
+    with pytest.raises(RuntimeError):
+        s._restore(sid)
+    s.init()
+    assert s.unlock(1)
+    s.set(0x0101, b"world")
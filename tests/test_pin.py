@@ -13,6 +13,7 @@ def test_init_pin():
     assert common.memory_equals(sc, sp)
 
 
+@pytest.mark.real_kdf
 def test_change_pin():
     sc, sp = common.init(unlock=True)
     for s in (sc, sp):
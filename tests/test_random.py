@@ -65,7 +65,9 @@ class StorageComparison(RuleBasedStateMachine):
 
     @invariant()
     def dumps_agree(self):
-        assert self.sc._dump() == self.sp._dump()
+        assert common.memory_equals(self.sc, self.sp), common.diverging_pages(
+            self.sc, self.sp
+        )
 
     @invariant()
     def pin_counters_agree(self):
@@ -34,7 +34,7 @@ def test_set_get():
 
     # check data are not changed by gets
     datasc = sc._dump()
-    datasp = sp._dump()
+    datasp = [bytes(sector) for sector in sp._dump()]
 
     for s in (sc, sp):
         assert s.get(0xAAAA) == b"something else"
@@ -0,0 +1,55 @@
+import pytest
+
+from c0.storage import Storage as StorageC0
+
+from . import common
+
+
+def test_set_many():
+    sc, sp = common.init(unlock=True)
+    items = [(0x0100 + i, bytes([i]) * i) for i in range(40)]
+    items += [(0x8101, b"public"), (0x0105, b"overwritten")]
+    for s in (sc, sp):
+        s.set_many(items)
+        s.set_many([])
+        assert s.get(0x0105) == b"overwritten"
+        assert s.get(0x0127) == b"\x27" * 0x27
+        assert s.get(0x8101) == b"public"
+    assert common.memory_equals(sc, sp)
+
+
+def test_set_many_c0():
+    sequential = StorageC0()
+    batched = StorageC0()
+    items = [(0x0100 + i % 30, bytes([i]) * i) for i in range(50)]
+    for s in (sequential, batched):
+        s.init()
+        assert s.unlock(1)
+    for key, val in items:
+        sequential.set(key, val)
+    batched.set_many(items)
+    assert batched._dump() == sequential._dump()
+    for key, val in dict(items).items():
+        assert batched.get(key) == val
+
+    with pytest.raises(RuntimeError):
+        batched.set_many([(0x0101, b"a"), (0x0001, b"pin")])
+    assert batched.get(0x0101) == dict(items)[0x0101]
+
+
+def test_set_many_compacts_once_c0():
+    sc0 = StorageC0()
+    sc0.init()
+    assert sc0.unlock(1)
+    for i in range(60):
+        sc0.set(0x0101, bytes([i]) * 1000)
+    sc0._reset_flash_stats()
+    items = [(0x0200 + i, b"b" * 1000) for i in range(10)]
+    sc0.set_many(items)
+    assert sum(sc0._get_flash_stats().erase_count) == 2
+    for key, val in items:
+        assert sc0.get(key) == val
+
+    with pytest.raises(RuntimeError):
+        sc0.set_many([(0x0300 + i, b"c" * 10000) for i in range(7)])
+    assert sum(sc0._get_flash_stats().erase_count) == 2
@@ -0,0 +1,164 @@
+import pytest
+
+from c0.storage import Storage as StorageC0
+
+
+def new_storage(tail_records: bool = False, flash: bytes = None) -> StorageC0:
+    s = StorageC0(tail_records=tail_records)
+    if flash is not None:
+        s._set_flash_buffer(flash)
+    s.init()
+    assert s.unlock(1)
+    return s
+
+
+def set_stream(s, key: int, val: bytes, chunk: int) -> None:
+    s.set_begin(key, len(val))
+    for i in range(0, len(val), chunk):
+        s.set_append(val[i : i + chunk])
+    s.set_commit()
+
+
+def erases(s) -> int:
+    return sum(s._get_flash_stats().erase_count)
+
+
+@pytest.mark.parametrize("tail_records", [False, True])
+@pytest.mark.parametrize("chunk", [1, 3, 4, 64, 10000])
+def test_set_stream(tail_records, chunk):
+    s = new_storage(tail_records)
+    ref = new_storage(tail_records)
+    vals = [
+        (0x0101, bytes(range(256)) * 39 + b"tail"),
+        (0x0102, b""),
+        (0x0101, b"abcde"),
+    ]
+    for key, val in vals:
+        set_stream(s, key, val, chunk)
+        ref.set(key, val)
+    assert s.get(0x0101) == b"abcde"
+    assert s.get(0x0102) == b""
+    # the same items as written by set
+    assert [bytes(d) for d in s._dump()] == [bytes(d) for d in ref._dump()]
+
+    s = new_storage(tail_records, s._get_flash_buffer())
+    assert s.get(0x0101) == b"abcde"
+
+
+@pytest.mark.parametrize("tail_records", [False, True])
+def test_set_stream_torn(tail_records):
+    s = new_storage(tail_records)
+    s.set(0x0101, b"old")
+    s.set_begin(0x0101, 10000)
+    s.set_append(b"x" * 5000)
+    # a reset before the commit, the init moves the items away from the
+    # programmed chunk
+    flash = s._get_flash_buffer()
+    s = StorageC0(tail_records=tail_records)
+    s._set_flash_buffer(flash)
+    s._reset_flash_stats()
+    s.init()
+    assert erases(s) == 2
+    assert s.unlock(1)
+    assert s.get(0x0101) == b"old"
+    s.set(0x0102, b"new")
+    set_stream(s, 0x0103, b"y" * 10000, 1000)
+    s = new_storage(tail_records, s._get_flash_buffer())
+    assert s.get(0x0101) == b"old"
+    assert s.get(0x0102) == b"new"
+    assert s.get(0x0103) == b"y" * 10000
+
+
+def test_set_stream_incomplete():
+    s = new_storage()
+    s.set(0x0101, b"old")
+    s.set_begin(0x0101, 100)
+    with pytest.raises(RuntimeError):
+        s.set_append(b"x" * 101)
+    # other writes wait for the commit
+    with pytest.raises(RuntimeError):
+        s.set(0x0102, b"new")
+    with pytest.raises(RuntimeError):
+        s.set_begin(0x0102, 3)
+    s.set_append(b"x" * 50)
+    with pytest.raises(RuntimeError):
+        s.set_commit()
+    assert s.get(0x0101) == b"old"
+    s.set(0x0102, b"new")
+    with pytest.raises(RuntimeError):
+        s.set_commit()
+
+    # nothing programmed, nothing to reclaim
+    before = erases(s)
+    s.set_begin(0x0101, 100)
+    with pytest.raises(RuntimeError):
+        s.set_commit()
+    assert erases(s) == before
+    assert s.get(0x0101) == b"old"
+
+
+def test_set_stream_abort():
+    s = new_storage()
+    s.set(0x0101, b"old")
+    s.set_begin(0x0101, 100)
+    s.set_append(b"x" * 50)
+    s.set_abort()
+    with pytest.raises(RuntimeError):
+        s.set_commit()
+    assert s.get(0x0101) == b"old"
+    s.set(0x0102, b"new")
+    s.set_abort()
+    s = new_storage(flash=s._get_flash_buffer())
+    assert s.get(0x0101) == b"old"
+    assert s.get(0x0102) == b"new"
+
+
+def test_set_stream_unlock():
+    s = new_storage()
+    s.set_begin(0x0101, 100)
+    s.set_append(b"x" * 10)
+    # a failed unlock drops the open write
+    assert not s.unlock(2)
+    assert s.unlock(1)
+    s.set(0x0102, b"new")
+
+    # unlocks use up the PIN fail area, which is then written again
+    s.set_begin(0x0101, 100)
+    s.set_append(b"x" * 10)
+    for _ in range(40):
+        assert s.unlock(1)
+    assert not s.unlock(2)
+    assert s.unlock(1)
+    with pytest.raises(RuntimeError):
+        s.set_commit()
+    assert s.get(0x0102) == b"new"
+
+
+def test_set_stream_compacting():
+    s = new_storage()
+    for i in range(60):
+        s.set(0x0100 + i % 6, bytes([i]) * 1000)
+    assert not s.maintenance(3)
+    set_stream(s, 0x0101, b"z" * 3000, 256)
+    # the compaction waits for the open write
+    s.set_begin(0x0102, 4)
+    assert not s.maintenance(100)
+    s.set_append(b"abcd")
+    s.set_commit()
+    while not s.maintenance(3):
+        pass
+    s = new_storage(flash=s._get_flash_buffer())
+    assert s.get(0x0101) == b"z" * 3000
+    assert s.get(0x0102) == b"abcd"
+
+
+def test_set_stream_full():
+    s = new_storage()
+    for i in range(60):
+        s.set(0x0100 + i % 6, bytes([i]) * 1000)
+    before = erases(s)
+    set_stream(s, 0x0110, b"w" * 20000, 4096)
+    assert erases(s) > before
+    assert s.get(0x0110) == b"w" * 20000
+    with pytest.raises(RuntimeError):
+        s.set_begin(0x0111, 60000)
@@ -0,0 +1,57 @@
+import pytest
+
+from c0.storage import Storage as StorageC0
+
+from . import common
+
+
+def test_snapshot_restore():
+    sc, _ = common.init(unlock=True)
+    sc.set(0xBEEF, b"hello")
+    snap = sc._snapshot()
+    before = sc._dump()
+
+    sc.set(0xBEEF, b"world")
+    sc.set(0x0101, b"x" * 1000)
+    branch = sc._snapshot()
+    after = sc._dump()
+    assert after != before
+
+    sc._restore(snap)
+    assert sc._dump() == before
+    sc.init(common.test_uid)
+    assert sc.unlock(1)
+    assert sc.get(0xBEEF) == b"hello"
+    with pytest.raises(RuntimeError):
+        sc.get(0x0101)
+
+    sc._restore(branch)
+    assert sc._dump() == after
+    sc.init(common.test_uid)
+    assert sc.unlock(1)
+    assert sc.get(0xBEEF) == b"world"
+
+    sc._free_snapshot(snap)
+    sc._free_snapshot(branch)
+    with pytest.raises(RuntimeError):
+        sc._restore(snap)
+
+
+def test_snapshot_restore_c0():
+    sc0 = StorageC0()
+    sc0.init()
+    assert sc0.unlock(1)
+    sc0.set(0xBEEF, b"hello")
+    snap = sc0._snapshot()
+    before = sc0._dump()
+
+    for i in range(100):
+        sc0.set(0xBEEF, bytes([i]) * 1000)
+    assert sc0._dump() != before
+
+    sc0._restore(snap)
+    assert sc0._dump() == before
+    sc0.init()
+    assert sc0.unlock(1)
+    assert sc0.get(0xBEEF) == b"hello"
+    sc0._free_snapshot(snap)
@@ -0,0 +1,84 @@
+import struct
+
+from c0.storage import Storage as StorageC0
+
+
+def new_storage(tail_records: bool, flash: bytes = None) -> StorageC0:
+    s = StorageC0(tail_records=tail_records)
+    if flash is not None:
+        s._set_flash_buffer(flash)
+    s.init()
+    assert s.unlock(1)
+    return s
+
+
+def active_magic(s) -> bytes:
+    return next(d[:4] for d in s._dump() if d[:3] == b"NRC")
+
+
+def test_tail_records():
+    s = new_storage(True)
+    assert active_magic(s) == b"NRCT"
+    vals = {}
+    for i in range(200):
+        key = 0x0100 + i % 20
+        vals[key] = bytes([i]) * (i % 7)
+        s.set(key, vals[key])
+    for key, val in vals.items():
+        assert s.get(key) == val
+
+    (prefix,) = struct.unpack_from("<I", s._dump()[0], 4)
+    length = prefix >> 16
+    (trailer,) = struct.unpack_from("<I", s._dump()[0], 8 + (length + 3) // 4 * 4)
+    assert trailer == prefix
+
+    s = new_storage(True, s._get_flash_buffer())
+    for key, val in vals.items():
+        assert s.get(key) == val
+
+
+def test_tail_records_upgrade():
+    s = new_storage(False)
+    s.set(0x0101, b"hello")
+    assert active_magic(s) == b"NRCW"
+
+    s = new_storage(True, s._get_flash_buffer())
+    assert active_magic(s) == b"NRCW"
+    assert s.get(0x0101) == b"hello"
+    s._reset_flash_stats()
+    for i in range(70):
+        s.set(0x0102, bytes([i]) * 1000)
+    assert sum(s._get_flash_stats().erase_count) == 2
+    assert active_magic(s) == b"NRCT"
+    assert s.get(0x0101) == b"hello"
+    assert s.unlock(1)
+
+    # and back to the old format
+    s = new_storage(False, s._get_flash_buffer())
+    for i in range(70):
+        s.set(0x0102, bytes([i]) * 1000)
+    assert active_magic(s) == b"NRCW"
+    assert s.get(0x0101) == b"hello"
+    assert s.get(0x0102) == bytes([69]) * 1000
+
+
+def test_tail_records_torn_item():
+    s = new_storage(True)
+    s.set(0x0101, b"hello")
+    s.set(0x0102, b"world")
+    flash = bytearray(s._get_flash_buffer())
+    sector = 0x010000
+    dump = s._dump()[0]
+    used = len(bytes(dump).rstrip(b"\xff"))
+
+    # an item whose commit word was not written before a reset
+    flash[sector + used : sector + used + 8] = (
+        struct.pack("<HH", 0x0101, 3) + b"abc\x00"
+    )
+    s = new_storage(True, bytes(flash))
+    assert s.get(0x0101) == b"hello"
+    assert s.get(0x0102) == b"world"
+    assert active_magic(s) == b"NRCT"
+    assert s._dump()[0][:4] == b"\xff" * 4
+    s.set(0x0101, b"again")
+    assert s.get(0x0101) == b"again"
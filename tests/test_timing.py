@@ -0,0 +1,40 @@
+from c0.storage import Storage as StorageC0
+from python.src import consts
+
+from . import common
+
+# Upper bound on the virtual latency of a set which does not compact.
+MAX_SET_US = 20000
+
+
+def test_compaction_latency():
+    sc, _ = common.init(unlock=True)
+    erase_us = sc._get_flash_timing().erase_64k_us
+
+    t = sc._get_clock()
+    sc.set(0x8101, b"a" * (consts.NORCOW_SECTOR_SIZE // 2))
+    assert sc._get_clock() - t < MAX_SET_US
+
+    # the second set has to compact the sector
+    t = sc._get_clock()
+    sc.set(0x8101, b"b" * (consts.NORCOW_SECTOR_SIZE // 2))
+    assert sc._get_clock() - t >= erase_us
+
+
+def test_timing_model_c0():
+    sc0 = StorageC0()
+    sc0.init()
+    assert sc0.unlock(1)
+
+    timing = sc0._get_flash_timing()
+    timing.word_program_us = 100
+    sc0._set_flash_timing(timing)
+    t = sc0._get_clock()
+    sc0.set(0x0101, bytes(range(100)))
+    assert sc0._get_clock() - t == 26 * 100
+
+    # a failed PIN check makes the next check wait for one second
+    assert not sc0.check_pin(2)
+    t = sc0._get_clock()
+    assert sc0.check_pin(1)
+    assert sc0._get_clock() - t >= 1000000
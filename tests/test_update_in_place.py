@@ -0,0 +1,128 @@
+import random
+
+import pytest
+
+from c0.storage import Storage as StorageC0
+
+
+def new_storage(**options) -> StorageC0:
+    s = StorageC0(**options)
+    s.init()
+    assert s.unlock(1)
+    return s
+
+
+def programmed(s) -> int:
+    return s._get_flash_stats().programmed_bytes
+
+
+def test_skip_identical():
+    s = new_storage()
+    s.set(0x0101, b"hello")
+    s.set(0x0102, b"")
+    dump = [bytes(d) for d in s._dump()]
+    before = programmed(s)
+    s.set(0x0101, b"hello")
+    s.set(0x0102, b"")
+    assert programmed(s) == before
+    assert [bytes(d) for d in s._dump()] == dump
+
+
+def test_update_in_place():
+    s = new_storage()
+    s.set(0x0101, b"\xff" * 10)
+    s.set(0x0102, b"next")
+    dump = bytes(s._dump()[0])
+    used = len(dump.rstrip(b"\xff"))
+    before = programmed(s)
+
+    # one word is programmed at once, the unaligned tail with its padding
+    s.set(0x0101, b"\xff" * 8 + b"\x7f\xff")
+    assert s.get(0x0101) == b"\xff" * 8 + b"\x7f\xff"
+    assert programmed(s) - before == 4
+    s.set(0x0101, b"\x00" * 4 + b"\xff" * 4 + b"\x7f\xff")
+    assert programmed(s) - before == 8
+    after = bytes(s._dump()[0])
+    assert after[used:] == dump[used:]
+
+    # changing more than one word, setting bits or changing the length
+    # appends
+    s.set(0x0101, b"\x00" * 8 + b"\x7f\x7f")
+    assert len(bytes(s._dump()[0]).rstrip(b"\xff")) > used
+    assert s.get(0x0101) == b"\x00" * 8 + b"\x7f\x7f"
+    s.set(0x0101, b"\xff" * 10)
+    s.set(0x0102, b"nex")
+    assert len(bytes(s._dump()[0]).rstrip(b"\xff")) > used
+    assert s.get(0x0101) == b"\xff" * 10
+    assert s.get(0x0102) == b"nex"
+
+
+@pytest.mark.parametrize("tail_records", [False, True])
+def test_update_in_place_random(tail_records):
+    rnd = random.Random(tail_records)
+    s = new_storage(tail_records=tail_records)
+    vals = {}
+    for i in range(3000):
+        key = 0x0100 + rnd.randrange(20)
+        val = vals.get(key)
+        if val is not None and rnd.random() < 0.5:
+            # clear some bits or keep the value
+            val = bytes(b & rnd.randrange(256) for b in val)
+        else:
+            val = rnd.randbytes(rnd.choice([0, 1, 3, 4, 7, 64]))
+        vals[key] = val
+        s.set(key, val)
+        if i % 500 == 0:
+            s.init()
+            assert s.unlock(1)
+        if i % 10 == 0:
+            s.maintenance(3)
+    assert s.get_many(vals.keys()) == list(vals.values())
+    s.init()
+    assert s.unlock(1)
+    assert s.get_many(vals.keys()) == list(vals.values())
+
+
+def test_update_in_place_compacting():
+    s = new_storage()
+    s.set(0x0110, b"\xff" * 8)
+    for i in range(60):
+        s.set(0x0100 + i % 6, bytes([i]) * 1000)
+    # the item is copied by the first steps and updated in both sectors
+    assert not s.maintenance(3)
+    s.set(0x0110, b"\x0f" * 4 + b"\xff" * 4)
+    while not s.maintenance(3):
+        pass
+    assert s.get(0x0110) == b"\x0f" * 4 + b"\xff" * 4
+    s.init()
+    assert s.unlock(1)
+    assert s.get(0x0110) == b"\x0f" * 4 + b"\xff" * 4
+
+
+@pytest.mark.parametrize(
+    "tail_records, new",
+    [
+        (False, b"\x0f" * 4 + b"\xff" * 6),
+        (True, b"\x0f" * 4 + b"\xff" * 6),
+        (True, b"\x0f" * 10),
+    ],
+)
+def test_update_in_place_reset(tail_records, new):
+    old = b"\xff" * 10
+    s = new_storage(tail_records=tail_records)
+    s.set(0x0110, old)
+    flash = s._get_flash_buffer()
+    # a reset at any flash operation of the set leaves either value
+    for n in range(8):
+        s = StorageC0(tail_records=tail_records)
+        s._set_flash_buffer(flash)
+        s.init()
+        assert s.unlock(1)
+        s._power_cut(n)
+        s.set(0x0110, new)
+        torn = s._get_flash_buffer()
+        s = StorageC0(tail_records=tail_records)
+        s._set_flash_buffer(torn)
+        s.init()
+        assert s.unlock(1)
+        assert s.get(0x0110) in (old, new)